@@ -0,0 +1,87 @@
+// Times the BVH build on a generated scene of spheres and boxes for 1..N pool
+// workers and checks that every thread count produces the same tree.
+//
+// Usage: bvh_build_scaling [objects] [max_threads] [repeats]
+
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "common.h"
+#include "sampler.h"
+#include "material.h"
+#include "sphere.h"
+#include "box.h"
+#include "scene.h"
+#include "bvh.h"
+#include "thread_pool.h"
+
+scene scaling_scene(size_t count) {
+	scene world;
+	sampler rng(1);
+	auto white = world.materials.add<lambertian>(color(0.73, 0.73, 0.73));
+	for (size_t i = 0; i < count; ++i) {
+		auto center = vec3::random(rng, 0, 1000);
+		// One box for every three spheres
+		if (i % 4 == 3) {
+			auto half = vec3::random(rng, 0.2, 2);
+			world.objects.add(std::make_shared<box>(center - half, center + half, white));
+		}
+		else
+			world.objects.add(std::make_shared<sphere>(center, rng.next_double(0.2, 2), white));
+	}
+	return world;
+}
+
+struct build_result {
+	double seconds;
+	double sah_cost;
+	size_t nodes;
+	size_t leaves;
+};
+
+build_result time_build(const visible_collection& world, thread_pool* pool, int repeats) {
+	build_result result{ infinity, 0, 0, 0 };
+	for (int i = 0; i < repeats; ++i) {
+		bvh_build_options options;
+		options.pool = pool;
+		bvh_build_stats stats;
+		bvh_node tree(world, 0.0, 1.0, options, &stats);
+		// Best of the repeats, the tree itself is identical every time
+		result.seconds = std::min(result.seconds, stats.build_seconds);
+		result.sah_cost = tree.sah_cost(options);
+		result.nodes = stats.nodes;
+		result.leaves = stats.leaves;
+	}
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	size_t objects = argc > 1 ? std::stoul(argv[1]) : 1000000;
+	size_t max_threads = argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+	int repeats = argc > 3 ? std::stoi(argv[3]) : 3;
+	if (max_threads == 0) max_threads = 1;
+
+	std::cerr << "Generating " << objects << " objects...\n";
+	auto generated = scaling_scene(objects);
+	const auto& world = generated.objects;
+
+	// The serial build without a pool is the reference every parallel build must match exactly
+	auto serial = time_build(world, nullptr, repeats);
+	std::printf("%8s %10s %8s %10s %22s\n", "threads", "seconds", "speedup", "nodes", "sah_cost");
+	std::printf("%8s %10.4f %8.2f %10zu %22a\n", "serial", serial.seconds, 1.0, serial.nodes, serial.sah_cost);
+
+	bool deterministic = true;
+	for (size_t threads = 1; threads <= max_threads; ++threads) {
+		thread_pool pool(threads);
+		auto parallel = time_build(world, &pool, repeats);
+		std::printf("%8zu %10.4f %8.2f %10zu %22a\n", threads, parallel.seconds, serial.seconds / parallel.seconds, parallel.nodes, parallel.sah_cost);
+		if (parallel.sah_cost != serial.sah_cost || parallel.nodes != serial.nodes || parallel.leaves != serial.leaves) {
+			std::cerr << "ERROR: the tree built on " << threads << " threads differs from the serial one.\n";
+			deterministic = false;
+		}
+	}
+	return deterministic ? EXIT_SUCCESS : EXIT_FAILURE;
+}
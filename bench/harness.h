@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Keeps the compiler from discarding a benchmarked result
+template <typename T>
+inline void do_not_optimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile const void* sink;
+	sink = &value;
+#endif
+}
+
+// Minimal microbenchmark runner. Every benchmark is warmed up, its batch size is
+// grown until one batch takes at least `sample_ms`, and then `samples` batches
+// are timed. The median ns/op is reported with the median absolute deviation
+// and the fastest and slowest batch.
+//
+// Options: --filter <substring> --samples <count> --sample-ms <ms> --json
+class bench_runner {
+public:
+	bench_runner(int argc, char* argv[]) {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--filter" && i + 1 < argc) filter = argv[++i];
+			else if (arg == "--samples" && i + 1 < argc) samples = std::max(1, std::atoi(argv[++i]));
+			else if (arg == "--sample-ms" && i + 1 < argc) sample_ms = std::max(0.1, std::atof(argv[++i]));
+			else if (arg == "--json") json = true;
+			else {
+				std::fprintf(stderr, "Usage: %s [--filter <substring>] [--samples <count>] [--sample-ms <ms>] [--json]\n", argv[0]);
+				std::exit(1);
+			}
+		}
+		if (!json)
+			std::printf("%-44s %12s %9s %12s %12s\n", "benchmark", "ns/op", "mad", "min", "max");
+	}
+
+	bool enabled(const std::string& name) const {
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+
+	// Times op(i) for i = 0, 1, 2... so benchmarks can cycle through prepared inputs
+	template <typename F>
+	void run(const std::string& name, F op) {
+		if (!enabled(name)) return;
+
+		size_t counter = 0;
+		auto time_batch = [&](size_t batch) {
+			auto start = clock::now();
+			for (size_t i = 0; i < batch; ++i)
+				do_not_optimize(op(counter++));
+			return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+		};
+
+		// Warm caches and branch predictors, then find a batch long enough to time reliably
+		size_t batch = 1;
+		while (time_batch(batch) < 1e6 * sample_ms && batch < (size_t(1) << 40))
+			batch *= 2;
+		time_batch(batch);
+
+		std::vector<double> per_op(samples);
+		for (auto& ns : per_op)
+			ns = time_batch(batch) / batch;
+		std::sort(per_op.begin(), per_op.end());
+		auto median = per_op[per_op.size() / 2];
+		std::vector<double> deviations;
+		for (auto ns : per_op)
+			deviations.push_back(std::fabs(ns - median));
+		std::sort(deviations.begin(), deviations.end());
+		auto mad = deviations[deviations.size() / 2];
+
+		if (json)
+			std::printf("{\"name\":\"%s\",\"ns_per_op\":%.4f,\"mad_ns\":%.4f,\"min_ns\":%.4f,\"max_ns\":%.4f,\"ops_per_sample\":%zu,\"samples\":%d}\n",
+				name.c_str(), median, mad, per_op.front(), per_op.back(), batch, samples);
+		else
+			std::printf("%-44s %12.2f %8.1f%% %12.2f %12.2f\n", name.c_str(), median, 100.0 * mad / median, per_op.front(), per_op.back());
+		std::fflush(stdout);
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	std::string filter;
+	int samples = 15;
+	double sample_ms = 10.0;
+	bool json = false;
+};
@@ -0,0 +1,102 @@
+// RMSE against a high sample count reference as a function of samples per pixel,
+// with and without next-event estimation, to compare the noise of the two
+// integrators at equal sample counts and equal time.
+//
+// Usage: light_sampling_rmse [--scene <name>]... [--width <pixels>] [--max-spp <samples>] [--reference-spp <samples>]
+// Defaults to cornell_box and cornell_smoke at 96x96, 1..256 spp against 4096 spp.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "camera.h"
+#include "sampler.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "scene.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "thread_pool.h"
+
+// Root mean square error of the per-pixel averages over all channels
+double rmse(const accumulation_buffer& image, const accumulation_buffer& reference) {
+	double error = 0;
+	for (size_t n = 0; n < image.sums.size(); ++n)
+		for (int c = 0; c < 3; ++c) {
+			auto d = image.sums[n][c] / image.counts[n] - reference.sums[n][c] / reference.counts[n];
+			error += d * d;
+		}
+	return std::sqrt(error / (3.0 * image.sums.size()));
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<std::string> scene_names;
+	int width = 96, max_spp = 256, reference_spp = 4096;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--scene" && i + 1 < argc) scene_names.push_back(argv[++i]);
+		else if (arg == "--width" && i + 1 < argc) width = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--max-spp" && i + 1 < argc) max_spp = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--reference-spp" && i + 1 < argc) reference_spp = std::max(1, std::atoi(argv[++i]));
+		else {
+			std::fprintf(stderr, "Usage: %s [--scene <name>]... [--width <pixels>] [--max-spp <samples>] [--reference-spp <samples>]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (scene_names.empty()) scene_names = { "cornell_box", "cornell_smoke" };
+
+	thread_pool pool(physical_core_count());
+	for (const auto& name : scene_names) {
+		auto preset = find_scene_preset(name);
+		if (!preset) {
+			std::fprintf(stderr, "ERROR: Unknown scene %s.\n", name.c_str());
+			return 1;
+		}
+
+		sampler scene_rng(0);
+		scene world_scene;
+		{
+			sampler_scope bind(scene_rng);
+			world_scene = preset->build();
+		}
+		world_scene.find_lights();
+		bvh_build_options bvh_options;
+		bvh_options.pool = &pool;
+		bvh_node tree(world_scene.objects, 0.0, 1.0, bvh_options);
+		linear_bvh world(tree);
+		camera cam(preset->lookfrom, preset->lookat, vec3(0, 1, 0), preset->vfov, 1.0, preset->aperture, 10.0, 0.0, 1.0);
+
+		render_settings settings;
+		settings.width = settings.height = width;
+		settings.progress = false;
+
+		// The reference uses its own frame seed so its noise is independent of the measured runs
+		std::fprintf(stderr, "Rendering the %s reference at %d spp...\n", name.c_str(), reference_spp);
+		render_state reference;
+		reference.reset(width, width);
+		settings.samples_per_pixel = reference_spp;
+		settings.seed = 1;
+		render(cam, world, world_scene.lights, settings, pool, reference);
+
+		std::printf("%s, %zu lights\n%8s %12s %12s %10s %10s\n", name.c_str(), world_scene.lights.size(), "spp", "rmse_bsdf", "rmse_nee", "bsdf_s", "nee_s");
+		settings.seed = 0;
+		render_state state;
+		for (int spp = 1; spp <= max_spp; spp *= 2) {
+			settings.samples_per_pixel = spp;
+			double error[2], seconds[2];
+			for (int nee = 0; nee < 2; ++nee) {
+				settings.sample_lights = nee == 1;
+				state.reset(width, width);
+				seconds[nee] = render(cam, world, world_scene.lights, settings, pool, state).seconds;
+				error[nee] = rmse(state.buffer, reference.buffer);
+			}
+			std::printf("%8d %12.5f %12.5f %10.3f %10.3f\n", spp, error[0], error[1], seconds[0], seconds[1]);
+			std::fflush(stdout);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,281 @@
+// Microbenchmarks of the renderer's hot paths: primitive and box intersection,
+// BVH traversal, texture lookups and material scattering. Inputs are generated
+// up front from a fixed seed and cycled through so every run measures the same work.
+//
+// Usage: raytracer_bench [--filter <substring>] [--samples <count>] [--sample-ms <ms>] [--json]
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "harness.h"
+
+#include "common.h"
+#include "sampler.h"
+#include "random_number.h"
+#include "aabb.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "renderer.h"
+#include "material.h"
+#include "texture.h"
+#include "perlin.h"
+#include "scene.h"
+#include "image_io.h"
+
+constexpr size_t input_count = 4096; // Power of two, inputs are indexed with a mask
+
+// Rays from a shell of radius `distance` aimed at random points of the [-extent, extent] cube,
+// so a unit primitive at the origin is hit by a good fraction of them
+std::vector<ray> random_rays(sampler& rng, double distance, double extent) {
+	std::vector<ray> rays;
+	for (size_t i = 0; i < input_count; ++i) {
+		auto origin = distance * random_unit_vector(rng);
+		auto target = vec3::random(rng, -extent, extent);
+		rays.emplace_back(origin, target - origin, rng.next_double());
+	}
+	return rays;
+}
+
+void bench_primitives(bench_runner& bench, sampler& rng, const material* mat) {
+	auto rays = random_rays(rng, 5.0, 1.5);
+	auto run_visible = [&](const std::string& name, const visible& object) {
+		bench.run(name + "::intersect", [&](size_t i) {
+			intersection isect;
+			return object.intersect(rays[i & (input_count - 1)], 0.001, infinity, isect);
+		});
+		bench.run(name + "::hit_check", [&](size_t i) {
+			return object.hit_check(rays[i & (input_count - 1)], 0.001, infinity);
+		});
+		bench.run(name + "::occluded", [&](size_t i) {
+			return object.occluded(rays[i & (input_count - 1)], 0.001, infinity);
+		});
+	};
+
+	run_visible("sphere", sphere(vec3(0, 0, 0), 1.0, mat));
+	run_visible("moving_sphere", moving_sphere(vec3(0, -0.5, 0), vec3(0, 0.5, 0), 0.0, 1.0, 1.0, mat));
+	run_visible("xy_rect", xy_rect(-1, 1, -1, 1, 0, mat));
+	run_visible("xz_rect", xz_rect(-1, 1, -1, 1, 0, mat));
+	run_visible("yz_rect", yz_rect(-1, 1, -1, 1, 0, mat));
+
+	aabb box(vec3(-1, -1, -1), vec3(1, 1, 1));
+	bench.run("aabb::hit_check", [&](size_t i) {
+		return box.hit_check(rays[i & (input_count - 1)], 0.001, infinity);
+	});
+}
+
+void bench_traversal(bench_runner& bench, sampler& rng, const material* mat) {
+	if (!bench.enabled("bvh")) return;
+
+	constexpr int sphere_count = 10000;
+	visible_collection spheres;
+	for (int i = 0; i < sphere_count; ++i)
+		spheres.add(std::make_shared<sphere>(vec3::random(rng, -10, 10), rng.next_double(0.05, 0.3), mat));
+	bvh_node tree(spheres, 0.0, 1.0);
+	linear_bvh flat(tree);
+	wide_bvh<4> wide4(flat);
+	wide_bvh<8> wide8(flat);
+	auto rays = random_rays(rng, 30.0, 10.0);
+
+	bench.run("bvh_node::intersect (10k spheres)", [&](size_t i) {
+		intersection isect;
+		return tree.intersect(rays[i & (input_count - 1)], 0.001, infinity, isect);
+	});
+	bench.run("linear_bvh::intersect (10k spheres)", [&](size_t i) {
+		intersection isect;
+		return flat.intersect(rays[i & (input_count - 1)], 0.001, infinity, isect);
+	});
+	bench.run(std::string("wide_bvh<4>::intersect (10k spheres, ") + wide4.kernel_name() + ")", [&](size_t i) {
+		intersection isect;
+		return wide4.intersect(rays[i & (input_count - 1)], 0.001, infinity, isect);
+	});
+	bench.run(std::string("wide_bvh<8>::intersect (10k spheres, ") + wide8.kernel_name() + ")", [&](size_t i) {
+		intersection isect;
+		return wide8.intersect(rays[i & (input_count - 1)], 0.001, infinity, isect);
+	});
+	// Camera rays of 8x8 pixel blocks of a 64x64 image of the whole cloud, per block
+	constexpr int image_size = 64, block = 8;
+	std::vector<ray> camera_rays;
+	for (int by = 0; by < image_size; by += block)
+		for (int bx = 0; bx < image_size; bx += block)
+			for (int y = by; y < by + block; ++y)
+				for (int x = bx; x < bx + block; ++x)
+					camera_rays.emplace_back(vec3(0, 0, 30), vec3((x + 0.5) / image_size - 0.5, (y + 0.5) / image_size - 0.5, -1.2));
+	const size_t block_count = camera_rays.size() / (block * block);
+	auto packet = std::make_unique<ray_packet>();
+	std::vector<uint8_t> all(ray_packet::max_size, 1);
+	bench.run("linear_bvh::intersect (10k spheres, 8x8 camera rays one by one)", [&](size_t i) {
+		const ray* rays = &camera_rays[(i % block_count) * block * block];
+		int hits = 0;
+		for (int n = 0; n < block * block; ++n) {
+			intersection isect;
+			hits += flat.intersect(rays[n], 0.001, infinity, isect);
+		}
+		return hits;
+	});
+	bench.run("linear_bvh::intersect_packet (10k spheres, 8x8 camera rays)", [&](size_t i) {
+		const ray* rays = &camera_rays[(i % block_count) * block * block];
+		packet->clear();
+		for (int n = 0; n < block * block; ++n)
+			packet->add(rays[n], rng);
+		packet->prepare();
+		flat.intersect_packet(*packet, 0, packet->size, all.data());
+		return packet->t_max[0];
+	});
+	bench.run("linear_bvh::hit_check (10k spheres)", [&](size_t i) {
+		return flat.hit_check(rays[i & (input_count - 1)], 0.001, infinity);
+	});
+	bench.run("bvh_node::occluded (10k spheres)", [&](size_t i) {
+		return tree.occluded(rays[i & (input_count - 1)], 0.001, infinity);
+	});
+	bench.run("linear_bvh::occluded (10k spheres)", [&](size_t i) {
+		return flat.occluded(rays[i & (input_count - 1)], 0.001, infinity);
+	});
+	bench.run(std::string("wide_bvh<4>::occluded (10k spheres, ") + wide4.kernel_name() + ")", [&](size_t i) {
+		return wide4.occluded(rays[i & (input_count - 1)], 0.001, infinity);
+	});
+	bench.run(std::string("wide_bvh<8>::occluded (10k spheres, ") + wide8.kernel_name() + ")", [&](size_t i) {
+		return wide8.occluded(rays[i & (input_count - 1)], 0.001, infinity);
+	});
+}
+
+// Diffuse bounces off a cloud too big for L2, one ray per op in the order they were made
+// and sorted by ray_order_key() as the wavefront integrator's --reorder does
+void bench_ray_order(bench_runner& bench, sampler& rng, const material* mat) {
+	if (!bench.enabled("bvh") && !bench.enabled("ray_order_key")) return;
+
+	constexpr int sphere_count = 200000;
+	constexpr size_t bounce_count = 16384;
+	const double extent = 10 * std::cbrt(sphere_count / 10000.0); // As dense as the 10k cloud
+	visible_collection spheres;
+	for (int i = 0; i < sphere_count; ++i)
+		spheres.add(std::make_shared<sphere>(vec3::random(rng, -extent, extent), rng.next_double(0.05, 0.3), mat));
+	bvh_node tree(spheres, 0.0, 1.0);
+	linear_bvh flat(tree);
+	std::vector<ray> bounces;
+	while (bounces.size() < bounce_count) {
+		ray r(vec3::random(rng, -extent, extent), random_unit_vector(rng));
+		intersection isect;
+		if (!flat.intersect(r, 0.001, infinity, isect)) continue;
+		auto rec = isect.surface(r);
+		bounces.emplace_back(rec.point, rec.normal + random_unit_vector(rng));
+	}
+	const auto cloud_box = *flat.bounding_box(0, 1);
+	std::vector<std::pair<uint64_t, uint32_t>> order(bounce_count);
+	auto sort_bounces = [&] {
+		for (uint32_t n = 0; n < bounce_count; ++n)
+			order[n] = { ray_order_key(bounces[n], cloud_box), n };
+		std::sort(order.begin(), order.end());
+		return order[0].second;
+	};
+	sort_bounces();
+	std::vector<ray> sorted;
+	for (const auto& [key, n] : order)
+		sorted.push_back(bounces[n]);
+
+	bench.run("linear_bvh::intersect (200k spheres, bounces in order)", [&](size_t i) {
+		intersection isect;
+		return flat.intersect(bounces[i % bounce_count], 0.001, infinity, isect);
+	});
+	bench.run("linear_bvh::intersect (200k spheres, bounces sorted)", [&](size_t i) {
+		intersection isect;
+		return flat.intersect(sorted[i % bounce_count], 0.001, infinity, isect);
+	});
+	bench.run("ray_order_key + std::sort (16k bounces)", [&](size_t) {
+		return sort_bounces();
+	});
+}
+
+void bench_textures(bench_runner& bench, sampler& rng) {
+	std::vector<vec3> points;
+	std::vector<std::pair<double, double>> uvs;
+	for (size_t i = 0; i < input_count; ++i) {
+		points.push_back(vec3::random(rng, -50, 50));
+		uvs.emplace_back(rng.next_double(), rng.next_double());
+	}
+
+	if (bench.enabled("perlin")) {
+		perlin noise;
+		bench.run("perlin::noise", [&](size_t i) {
+			return noise.noise(points[i & (input_count - 1)]);
+		});
+		bench.run("perlin::turb", [&](size_t i) {
+			return noise.turb(points[i & (input_count - 1)]);
+		});
+	}
+
+	if (bench.enabled("image_texture")) {
+		// A throwaway noise image written through the regular output path and loaded back
+		constexpr int width = 512, height = 256;
+		std::vector<color> pixels;
+		for (int n = 0; n < width * height; ++n)
+			pixels.push_back(vec3::random(rng));
+		auto path = (std::filesystem::temp_directory_path() / "raytracer_bench_texture.png").string();
+		if (!write_image(path, image_format::png, { pixels.data(), width, height, 1 })) return;
+		image_texture image(path);
+		std::filesystem::remove(path);
+
+		bench.run("image_texture::value", [&](size_t i) {
+			auto& [u, v] = uvs[i & (input_count - 1)];
+			return image.value(u, v, points[i & (input_count - 1)]);
+		});
+	}
+}
+
+void bench_materials(bench_runner& bench, sampler& rng, scene& world) {
+	// Hits on a unit sphere seen from random directions, half of them from the inside
+	std::vector<ray> rays;
+	std::vector<hit> hits;
+	for (size_t i = 0; i < input_count; ++i) {
+		auto normal = random_unit_vector(rng);
+		auto origin = (rng.next_double() < 0.5 ? 3.0 : 0.5) * random_unit_vector(rng);
+		ray r(origin, normal - origin, 0.0);
+		hit rec;
+		rec.t = 1.0;
+		rec.point = normal;
+		rec.set_face_normal(r, normal);
+		std::tie(rec.u, rec.v) = sphere::get_sphere_uv(normal);
+		rays.push_back(r);
+		hits.push_back(rec);
+	}
+
+	auto run_material = [&](const std::string& name, const material* mat) {
+		bench.run(name + "::scatter_check", [&, mat](size_t i) {
+			return mat->scatter_check(rays[i & (input_count - 1)], hits[i & (input_count - 1)], rng);
+		});
+	};
+	run_material("lambertian", world.materials.add<lambertian>(color(0.5, 0.5, 0.5)));
+	run_material("lambertian (noise)", world.materials.add<lambertian>(std::make_shared<noise_texture>(4)));
+	run_material("metal", world.materials.add<metal>(color(0.8, 0.8, 0.9), 0.3));
+	run_material("dielectric", world.materials.add<dielectric>(1.5));
+	run_material("diffuse_light", world.materials.add<diffuse_light>(color(4, 4, 4)));
+	run_material("isotropic", world.materials.add<isotropic>(color(0.2, 0.4, 0.9)));
+
+	auto light = world.materials.add<diffuse_light>(color(4, 4, 4));
+	bench.run("diffuse_light::emitted", [&](size_t i) {
+		auto& rec = hits[i & (input_count - 1)];
+		return light->emitted(rec.u, rec.v, rec.point);
+	});
+}
+
+int main(int argc, char* argv[]) {
+	bench_runner bench(argc, argv);
+
+	sampler rng(2024);
+	sampler_scope bind(rng);
+	scene world;
+	auto mat = world.materials.add<lambertian>(color(0.5, 0.5, 0.5));
+
+	bench_primitives(bench, rng, mat);
+	bench_traversal(bench, rng, mat);
+	bench_ray_order(bench, rng, mat);
+	bench_textures(bench, rng);
+	bench_materials(bench, rng, world);
+	return 0;
+}
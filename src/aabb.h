@@ -1,7 +1,38 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+
 #include "common.h"
 
+// A ray prepared once per traversal for the slab tests of every box it meets: the
+// reciprocal direction, and per axis whether it points down, which picks the near and
+// far plane of each slab without comparing the two distances
+struct traversal_ray {
+	explicit traversal_ray(const ray& r);
+
+	vec3 origin;
+	vec3 inv_direction;
+	int negative[3];
+};
+
+inline traversal_ray::traversal_ray(const ray& r) : origin(r.origin()) {
+	for (int a = 0; a < 3; ++a) {
+		inv_direction[a] = 1.0 / r.direction()[a];
+		negative[a] = std::signbit(inv_direction[a]) ? 1 : 0;
+	}
+}
+
+// Narrows [t_min, t_max] to one slab, without branches. An origin on a plane of an axis the
+// ray runs along gives 0 * infinity = NaN, which fails both comparisons and leaves the
+// interval as it was.
+inline void clip_slab(double near_plane, double far_plane, double origin, double inv_direction, double& t_min, double& t_max) {
+	double t0 = (near_plane - origin) * inv_direction;
+	double t1 = (far_plane - origin) * inv_direction;
+	t_min = t0 > t_min ? t0 : t_min;
+	t_max = t1 < t_max ? t1 : t_max;
+}
+
 class aabb {
 public:
 	aabb() {}
@@ -10,32 +41,33 @@ public:
 	vec3 min() const { return minimum; }
 	vec3 max() const { return maximum; }
 
-	bool hit_check(const ray& r, double t_min, double t_max) const;
+	bool hit_check(const ray& r, double t_min, double t_max) const { return hit_check(traversal_ray(r), t_min, t_max); }
+	bool hit_check(const traversal_ray& r, double t_min, double t_max) const;
+
+	double surface_area() const {
+		auto d = maximum - minimum;
+		return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
 
 	vec3 minimum, maximum;
 };
 
-inline bool aabb::hit_check(const ray& r, double t_min, double t_max) const {
+inline bool aabb::hit_check(const traversal_ray& r, double t_min, double t_max) const {
 	for (int a = 0; a < 3; ++a) {
-		auto d = 1.0 / r.direction()[a];
-		auto t0 = (minimum[a] - r.origin()[a]) * d;
-		auto t1 = (maximum[a] - r.origin()[a]) * d;
-		if (d < 0.0) std::swap(t0, t1);
-		t_min = fmax(t0, t_min);
-		t_max = fmin(t1, t_max);
-		if (t_max <= t_min) return false;
+		const double planes[2] = { minimum[a], maximum[a] };
+		clip_slab(planes[r.negative[a]], planes[1 - r.negative[a]], r.origin[a], r.inv_direction[a], t_min, t_max);
 	}
-	return true;
+	return t_min < t_max;
 }
 
-aabb surrounding_box(aabb box0, aabb box1) {
+aabb surrounding_box(const aabb& box0, const aabb& box1) {
 	vec3 new_min(
-		fmin(box0.min().x(), box1.min().x()),
-		fmin(box0.min().y(), box1.min().y()),
-		fmin(box0.min().z(), box1.min().z()));
+		std::min(box0.minimum.x(), box1.minimum.x()),
+		std::min(box0.minimum.y(), box1.minimum.y()),
+		std::min(box0.minimum.z(), box1.minimum.z()));
 	vec3 new_max(
-		fmax(box0.max().x(), box1.max().x()),
-		fmax(box0.max().y(), box1.max().y()),
-		fmax(box0.max().z(), box1.max().z()));
+		std::max(box0.maximum.x(), box1.maximum.x()),
+		std::max(box0.maximum.y(), box1.maximum.y()),
+		std::max(box0.maximum.z(), box1.maximum.z()));
 	return { new_min, new_max };
 }
\ No newline at end of file
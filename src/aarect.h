@@ -1,33 +1,50 @@
 #pragma once
 
+#include <cassert>
+
 #include "common.h"
 #include "visible.h"
 
 class xy_rect : public visible {
 public:
 	xy_rect() : x0(0), x1(0), y0(0), y1(0), k(0) {}
-	xy_rect(double x0, double x1, double y0, double y1, double z, std::shared_ptr<material> material)
+	xy_rect(double x0, double x1, double y0, double y1, double z, const material* material)
 		: x0(x0), x1(x1), y0(y0), y1(y1), k(z), m(material) {
 		assert(x0 <= x1);
 		assert(y0 <= y1);
 	};
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override;
+	hit surface(const ray& r, const intersection& isect, int level) const override;
+	primitive_type type() const override { return primitive_type::xy_rect; }
+
+	const material* light_material() const override { return m; }
+	double pdf_value(const vec3& origin, const vec3& direction) const override;
+	vec3 random(const vec3& origin, sampler& rng) const override;
 
 private:
-	std::shared_ptr<material> m;
 	double x0, x1, y0, y1, k;
+	const material* m;
 };
 
-std::optional<hit> xy_rect::hit_check(const ray& r, double t_min, double t_max) const {
+bool xy_rect::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
 	auto t = (this->k - r.origin().z()) / r.direction().z();
 	if (t < t_min || t > t_max)
-		return std::nullopt;
+		return false;
 	auto x = r.origin().x() + t * r.direction().x();
 	auto y = r.origin().y() + t * r.direction().y();
 	if (x < this->x0 || x > this->x1 || y < this->y0 || y > this->y1)
-		return std::nullopt;
+		return false;
+
+	isect.record(t, this);
+	return true;
+}
+
+hit xy_rect::surface(const ray& r, const intersection& isect, int level) const {
+	auto t = isect.t;
+	auto x = r.origin().x() + t * r.direction().x();
+	auto y = r.origin().y() + t * r.direction().y();
 
 	hit rec;
 	rec.t = t;
@@ -41,6 +58,23 @@ std::optional<hit> xy_rect::hit_check(const ray& r, double t_min, double t_max)
 	return rec;
 }
 
+double xy_rect::pdf_value(const vec3& origin, const vec3& direction) const {
+	intersection isect;
+	if (!intersect(ray(origin, direction), 0.001, infinity, isect)) return 0;
+
+	// Converts the uniform density over the area to solid angle
+	auto area = (this->x1 - this->x0) * (this->y1 - this->y0);
+	auto distance_squared = isect.t * isect.t * direction.length_squared();
+	auto cosine = fabs(direction.z()) / direction.length();
+	if (area <= 0 || cosine <= 0) return 0;
+	return distance_squared / (cosine * area);
+}
+
+vec3 xy_rect::random(const vec3& origin, sampler& rng) const {
+	auto point = vec3(rng.next_double(this->x0, this->x1), rng.next_double(this->y0, this->y1), this->k);
+	return point - origin;
+}
+
 std::optional<aabb> xy_rect::bounding_box(double time0, double time1) const {
 	// Adds some padding on the z dimension
 	return aabb(
@@ -52,28 +86,43 @@ std::optional<aabb> xy_rect::bounding_box(double time0, double time1) const {
 class xz_rect : public visible {
 public:
 	xz_rect() : x0(0), x1(0), z0(0), z1(0), k(0) {}
-	xz_rect(double x0, double x1, double z0, double z1, double y, std::shared_ptr<material> material)
+	xz_rect(double x0, double x1, double z0, double z1, double y, const material* material)
 		: x0(x0), x1(x1), z0(z0), z1(z1), k(y), m(material) {
 		assert(x0 <= x1);
 		assert(z0 <= z1);
 	};
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override;
+	hit surface(const ray& r, const intersection& isect, int level) const override;
+	primitive_type type() const override { return primitive_type::xz_rect; }
+
+	const material* light_material() const override { return m; }
+	double pdf_value(const vec3& origin, const vec3& direction) const override;
+	vec3 random(const vec3& origin, sampler& rng) const override;
 
 private:
-	std::shared_ptr<material> m;
 	double x0, x1, z0, z1, k;
+	const material* m;
 };
 
-std::optional<hit> xz_rect::hit_check(const ray& r, double t_min, double t_max) const {
+bool xz_rect::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
 	auto t = (this->k - r.origin().y()) / r.direction().y();
 	if (t < t_min || t > t_max)
-		return std::nullopt;
+		return false;
 	auto x = r.origin().x() + t * r.direction().x();
 	auto z = r.origin().z() + t * r.direction().z();
 	if (x < this->x0 || x > this->x1 || z < this->z0 || z > this->z1)
-		return std::nullopt;
+		return false;
+
+	isect.record(t, this);
+	return true;
+}
+
+hit xz_rect::surface(const ray& r, const intersection& isect, int level) const {
+	auto t = isect.t;
+	auto x = r.origin().x() + t * r.direction().x();
+	auto z = r.origin().z() + t * r.direction().z();
 
 	hit rec;
 	rec.t = t;
@@ -87,6 +136,23 @@ std::optional<hit> xz_rect::hit_check(const ray& r, double t_min, double t_max)
 	return rec;
 }
 
+double xz_rect::pdf_value(const vec3& origin, const vec3& direction) const {
+	intersection isect;
+	if (!intersect(ray(origin, direction), 0.001, infinity, isect)) return 0;
+
+	// Converts the uniform density over the area to solid angle
+	auto area = (this->x1 - this->x0) * (this->z1 - this->z0);
+	auto distance_squared = isect.t * isect.t * direction.length_squared();
+	auto cosine = fabs(direction.y()) / direction.length();
+	if (area <= 0 || cosine <= 0) return 0;
+	return distance_squared / (cosine * area);
+}
+
+vec3 xz_rect::random(const vec3& origin, sampler& rng) const {
+	auto point = vec3(rng.next_double(this->x0, this->x1), this->k, rng.next_double(this->z0, this->z1));
+	return point - origin;
+}
+
 std::optional<aabb> xz_rect::bounding_box(double time0, double time1) const {
 	// Adds some padding on the y dimension
 	return aabb(
@@ -98,28 +164,43 @@ std::optional<aabb> xz_rect::bounding_box(double time0, double time1) const {
 class yz_rect : public visible {
 public:
 	yz_rect() : y0(0), y1(0), z0(0), z1(0), k(0) {}
-	yz_rect(double y0, double y1, double z0, double z1, double x, std::shared_ptr<material> material)
+	yz_rect(double y0, double y1, double z0, double z1, double x, const material* material)
 		: y0(y0), y1(y1), z0(z0), z1(z1), k(x), m(material) {
 		assert(y0 <= y1);
 		assert(z0 <= z1);
 	};
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override;
+	hit surface(const ray& r, const intersection& isect, int level) const override;
+	primitive_type type() const override { return primitive_type::yz_rect; }
+
+	const material* light_material() const override { return m; }
+	double pdf_value(const vec3& origin, const vec3& direction) const override;
+	vec3 random(const vec3& origin, sampler& rng) const override;
 
 private:
-	std::shared_ptr<material> m;
 	double y0, y1, z0, z1, k;
+	const material* m;
 };
 
-std::optional<hit> yz_rect::hit_check(const ray& r, double t_min, double t_max) const {
+bool yz_rect::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
 	auto t = (this->k - r.origin().x()) / r.direction().x();
 	if (t < t_min || t > t_max)
-		return std::nullopt;
+		return false;
 	auto y = r.origin().y() + t * r.direction().y();
 	auto z = r.origin().z() + t * r.direction().z();
 	if (y < this->y0 || y > this->y1 || z < this->z0 || z > this->z1)
-		return std::nullopt;
+		return false;
+
+	isect.record(t, this);
+	return true;
+}
+
+hit yz_rect::surface(const ray& r, const intersection& isect, int level) const {
+	auto t = isect.t;
+	auto y = r.origin().y() + t * r.direction().y();
+	auto z = r.origin().z() + t * r.direction().z();
 
 	hit rec;
 	rec.t = t;
@@ -133,6 +214,23 @@ std::optional<hit> yz_rect::hit_check(const ray& r, double t_min, double t_max)
 	return rec;
 }
 
+double yz_rect::pdf_value(const vec3& origin, const vec3& direction) const {
+	intersection isect;
+	if (!intersect(ray(origin, direction), 0.001, infinity, isect)) return 0;
+
+	// Converts the uniform density over the area to solid angle
+	auto area = (this->y1 - this->y0) * (this->z1 - this->z0);
+	auto distance_squared = isect.t * isect.t * direction.length_squared();
+	auto cosine = fabs(direction.x()) / direction.length();
+	if (area <= 0 || cosine <= 0) return 0;
+	return distance_squared / (cosine * area);
+}
+
+vec3 yz_rect::random(const vec3& origin, sampler& rng) const {
+	auto point = vec3(this->k, rng.next_double(this->y0, this->y1), rng.next_double(this->z0, this->z1));
+	return point - origin;
+}
+
 std::optional<aabb> yz_rect::bounding_box(double time0, double time1) const {
 	// Adds some padding on the x dimension
 	return aabb(
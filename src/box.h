@@ -8,10 +8,14 @@
 class box : public visible {
 public:
 	box() {}
-	box(const vec3& point0, const vec3& point1, std::shared_ptr<material> material);
+	box(const vec3& point0, const vec3& point1, const material* material);
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override {
-		return sides.hit_check(r, t_min, t_max);
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override {
+		return sides.intersect(r, t_min, t_max, isect);
+	}
+
+	bool occluded(const ray& r, double t_min, double t_max) const override {
+		return sides.occluded(r, t_min, t_max);
 	}
 
 	std::optional<aabb> bounding_box(double time0, double time1) const override {
@@ -24,7 +28,7 @@ private:
 	visible_collection sides;
 };
 
-box::box(const vec3& p0, const vec3& p1, std::shared_ptr<material> mat) {
+box::box(const vec3& p0, const vec3& p1, const material* mat) {
 	box_min = p0;
 	box_max = p1;
 	sides.add(std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat));
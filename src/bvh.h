@@ -1,82 +1,461 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 #include "common.h"
+#include "sampler.h"
+#include "thread_pool.h"
 #include "visible.h"
 #include "visible_collection.h"
 
+enum class bvh_split {
+	median, // Pseudo-random axis, split at the object median
+	sah,    // Binned surface area heuristic
+};
+
+struct bvh_build_stats {
+	double build_seconds = 0;
+	size_t peak_bytes = 0; // Estimate of the builder's working set, from the counts of object bounds, index entries and nodes
+	size_t nodes = 0;
+	size_t leaves = 0;
+};
+
+struct bvh_build_options {
+	static constexpr int max_bin_count = 64;
+
+	bvh_split split = bvh_split::sah;
+	int bin_count = 16; // SAH bins per axis, 2 to max_bin_count; small ranges use fewer
+	double traversal_cost = 1.0;
+	double intersection_cost = 1.0; // Per primitive in a leaf, relative to one node visit
+	size_t max_leaf_size = 4;
+	thread_pool* pool = nullptr;      // Builds subtrees and large binning passes as tasks when set
+	size_t parallel_threshold = 4096; // Ranges smaller than this are built by a single task
+};
+
 class bvh_node : public visible {
 public:
 	bvh_node() {}
-	bvh_node(const visible_collection& visibles, double time0, double time1)
-		: bvh_node(visibles.objects, 0, visibles.objects.size(), time0, time1) {}
+	bvh_node(const visible_collection& visibles, double time0, double time1, const bvh_build_options& options = {}, bvh_build_stats* stats = nullptr)
+		: bvh_node(visibles.objects, 0, visibles.objects.size(), time0, time1, options, stats) {}
 
-	bvh_node(const std::vector<std::shared_ptr<visible>>& objects, size_t start, size_t end, double time0, double time1);
+	bvh_node(const std::vector<std::shared_ptr<visible>>& objects, size_t start, size_t end, double time0, double time1, const bvh_build_options& options = {}, bvh_build_stats* stats = nullptr);
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	bool occluded(const ray& r, double t_min, double t_max) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override { return box; }
 
+	// Expected cost of tracing a ray through the tree, relative to the root's surface area
+	double sah_cost(const bvh_build_options& options = {}) const;
+
 private:
+	friend class linear_bvh;
+
+	struct build_context;
+
+	void build(build_context& ctx, size_t begin, size_t end);
+	void build_median(build_context& ctx, size_t begin, size_t end);
+	void build_sah(build_context& ctx, size_t begin, size_t end);
+	static std::shared_ptr<bvh_node> make_child(build_context& ctx, size_t begin, size_t end);
+	static std::pair<std::shared_ptr<bvh_node>, std::shared_ptr<bvh_node>> make_children(build_context& ctx, size_t begin, size_t mid, size_t end);
+	double subtree_cost(const bvh_build_options& options) const;
+	// True when left and right are primitives rather than child nodes
+	bool holds_leaf() const;
+
+	// Traversal below the root, with the ray's slab data computed once
+	bool intersect(const ray& r, const traversal_ray& tr, double t_min, double t_max, intersection& isect) const;
+	bool occluded(const ray& r, const traversal_ray& tr, double t_min, double t_max) const;
+
 	std::shared_ptr<visible> left;
 	std::shared_ptr<visible> right;
+	const bvh_node* left_node = nullptr; // left and right when they are nodes, set once built
+	const bvh_node* right_node = nullptr;
+	std::vector<std::shared_ptr<visible>> leaf; // Only SAH leaves hold more than two objects
 	aabb box;
+	int axis = 0;
 };
 
-std::optional<hit> bvh_node::hit_check(const ray& r, double t_min, double t_max) const {
-	if (!box.hit_check(r, t_min, t_max)) return std::nullopt;
-	auto hit_left = left->hit_check(r, t_min, t_max);
-	auto hit_right = right->hit_check(r, t_min, hit_left ? hit_left->t : t_max);
-	return hit_right ? hit_right : hit_left;
+bool bvh_node::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
+	return intersect(r, traversal_ray(r), t_min, t_max, isect);
+}
+
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+	return occluded(r, traversal_ray(r), t_min, t_max);
+}
+
+bool bvh_node::intersect(const ray& r, const traversal_ray& tr, double t_min, double t_max, intersection& isect) const {
+	if (!box.hit_check(tr, t_min, t_max)) return false;
+	if (!leaf.empty()) {
+		bool hit_anything = false;
+		for (const auto& object : leaf)
+			if (object->intersect(r, t_min, hit_anything ? isect.t : t_max, isect)) hit_anything = true;
+		return hit_anything;
+	}
+	bool hit_left = left_node ? left_node->intersect(r, tr, t_min, t_max, isect) : left->intersect(r, t_min, t_max, isect);
+	auto right_max = hit_left ? isect.t : t_max;
+	bool hit_right = right_node ? right_node->intersect(r, tr, t_min, right_max, isect) : right->intersect(r, t_min, right_max, isect);
+	return hit_left || hit_right;
 }
 
-inline bool box_compare(const std::shared_ptr<visible> a, const std::shared_ptr<visible> b, int axis) {
-	auto box_a = a->bounding_box(0, 0);
-	auto box_b = b->bounding_box(0, 0);
-	if (!box_a || !box_b) std::cerr << "No bounding box in bvh_node constructor.\n";
-	return box_a.value().min()[axis] < box_b.value().min()[axis];
+bool bvh_node::occluded(const ray& r, const traversal_ray& tr, double t_min, double t_max) const {
+	if (!box.hit_check(tr, t_min, t_max)) return false;
+	if (!leaf.empty()) {
+		for (const auto& object : leaf)
+			if (object->occluded(r, t_min, t_max)) return true;
+		return false;
+	}
+	if (left_node ? left_node->occluded(r, tr, t_min, t_max) : left->occluded(r, t_min, t_max)) return true;
+	return right != left && (right_node ? right_node->occluded(r, tr, t_min, t_max) : right->occluded(r, t_min, t_max));
 }
 
-bool box_x_compare(const std::shared_ptr<visible> a, const std::shared_ptr<visible> b) {
-	return box_compare(a, b, 0);
+double bvh_node::sah_cost(const bvh_build_options& options) const {
+	return subtree_cost(options) / box.surface_area();
 }
 
-bool box_y_compare(const std::shared_ptr<visible> a, const std::shared_ptr<visible> b) {
-	return box_compare(a, b, 1);
+double bvh_node::subtree_cost(const bvh_build_options& options) const {
+	// A primitive beside a child node is tested whenever this node is entered
+	auto object_cost = [&](const std::shared_ptr<visible>& object) {
+		if (auto node = dynamic_cast<const bvh_node*>(object.get()))
+			return node->subtree_cost(options);
+		return options.intersection_cost * box.surface_area();
+	};
+
+	double cost = options.traversal_cost * box.surface_area();
+	if (!leaf.empty()) return cost + options.intersection_cost * leaf.size() * box.surface_area();
+	if (holds_leaf()) return cost + options.intersection_cost * (left == right ? 1 : 2) * box.surface_area();
+	cost += object_cost(left);
+	if (right != left) cost += object_cost(right);
+	return cost;
+}
+
+bool bvh_node::holds_leaf() const {
+	return !left_node && !right_node;
+}
+
+inline aabb object_box(const std::shared_ptr<visible>& object, double time0, double time1) {
+	auto box = object->bounding_box(time0, time1);
+	if (!box) std::cerr << "No bounding box in bvh_node constructor.\n";
+	return box.value();
+}
+
+inline vec3 box_centroid(const aabb& box) {
+	return 0.5 * (box.min() + box.max());
+}
+
+// Everything a build shares: per-object bounds are computed once and the
+// hierarchy is built by partitioning a single reference array in place
+struct bvh_reference {
+	aabb box;
+	vec3 centroid;
+	uint32_t object; // Relative to the first object of the built range
+};
+
+// Plain bounds so a whole array of bins can be reset without running constructors
+struct sah_bin {
+	double lo[3], hi[3];
+	size_t count;
+
+	static sah_bin empty() {
+		return { { infinity, infinity, infinity }, { -infinity, -infinity, -infinity }, 0 };
+	}
+
+	void grow(const aabb& box) {
+		for (int a = 0; a < 3; ++a) {
+			lo[a] = std::min(lo[a], box.minimum[a]);
+			hi[a] = std::max(hi[a], box.maximum[a]);
+		}
+		++count;
+	}
+
+	void merge(const sah_bin& other) {
+		for (int a = 0; a < 3; ++a) {
+			lo[a] = std::min(lo[a], other.lo[a]);
+			hi[a] = std::max(hi[a], other.hi[a]);
+		}
+		count += other.count;
+	}
+
+	aabb box() const {
+		return aabb(vec3(lo[0], lo[1], lo[2]), vec3(hi[0], hi[1], hi[2]));
+	}
+
+	double area() const {
+		if (count == 0) return 0.0;
+		double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+		return 2.0 * (dx * dy + dy * dz + dz * dx);
+	}
+};
+
+struct sah_bins {
+	static constexpr int max_bins = bvh_build_options::max_bin_count;
+	sah_bin axis[3][max_bins];
+};
+
+struct bvh_node::build_context {
+	const std::shared_ptr<visible>* objects;
+	const bvh_build_options& options;
+	std::vector<bvh_reference> refs;
+	std::atomic<size_t> nodes{ 0 };
+	std::atomic<size_t> leaves{ 0 };
+	std::atomic<size_t> leaf_objects{ 0 };
+
+	// How many pool tasks a pass over `span` references is worth splitting into
+	size_t chunks(size_t span) const {
+		if (!options.pool || span < 2 * options.parallel_threshold) return 1;
+		return std::min(span / options.parallel_threshold, 4 * options.pool->size());
+	}
+
+	// Runs fn(chunk, chunk_begin, chunk_end) for `count` even slices of [begin, end) on the pool
+	template <typename F>
+	void for_chunks(size_t begin, size_t end, size_t count, F fn) {
+		task_group group;
+		for (size_t c = 0; c < count; ++c)
+			options.pool->submit(group, [&, c] { fn(c, begin + (end - begin) * c / count, begin + (end - begin) * (c + 1) / count); });
+		options.pool->wait(group);
+	}
+};
+
+bvh_node::bvh_node(const std::vector<std::shared_ptr<visible>>& objects, size_t start, size_t end, double time0, double time1, const bvh_build_options& options, bvh_build_stats* stats) {
+	auto build_start = std::chrono::steady_clock::now();
+	if (options.split == bvh_split::sah && (options.bin_count < 2 || options.bin_count > bvh_build_options::max_bin_count)) {
+		std::cerr << "ERROR: " << options.bin_count << " SAH bins, expected 2 to " << bvh_build_options::max_bin_count << ".\n";
+		std::abort();
+	}
+
+	build_context ctx{ objects.data() + start, options };
+	ctx.refs.resize(end - start);
+	auto fill_refs = [&](size_t, size_t lo, size_t hi) {
+		for (size_t i = lo; i < hi; ++i) {
+			auto object_bounds = object_box(objects[start + i], time0, time1);
+			ctx.refs[i] = { object_bounds, box_centroid(object_bounds), static_cast<uint32_t>(i) };
+		}
+	};
+
+	if (options.pool) {
+		// Run the whole build as tasks, so forked subtrees land on the workers' own deques
+		ctx.for_chunks(0, end - start, ctx.chunks(end - start), fill_refs);
+		task_group group;
+		options.pool->submit(group, [&] { build(ctx, 0, end - start); });
+		options.pool->wait(group);
+	}
+	else {
+		fill_refs(0, 0, end - start);
+		build(ctx, 0, end - start);
+	}
+
+	if (stats) {
+		stats->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+		stats->nodes = ctx.nodes;
+		stats->leaves = ctx.leaves;
+		// The reference array lives for the whole build, nodes accumulate until the end
+		stats->peak_bytes =
+			(end - start) * sizeof(bvh_reference) +
+			ctx.nodes * (sizeof(bvh_node) + 2 * sizeof(void*)) +
+			ctx.leaf_objects * sizeof(std::shared_ptr<visible>);
+	}
 }
 
-bool box_z_compare(const std::shared_ptr<visible> a, const std::shared_ptr<visible> b) {
-	return box_compare(a, b, 2);
+std::shared_ptr<bvh_node> bvh_node::make_child(build_context& ctx, size_t begin, size_t end) {
+	auto child = std::make_shared<bvh_node>();
+	child->build(ctx, begin, end);
+	return child;
 }
 
-bvh_node::bvh_node(const std::vector<std::shared_ptr<visible>>& src, size_t start, size_t end, double time0, double time1) {
-	auto objects = src;
+std::pair<std::shared_ptr<bvh_node>, std::shared_ptr<bvh_node>> bvh_node::make_children(build_context& ctx, size_t begin, size_t mid, size_t end) {
+	if (!ctx.options.pool || end - begin < ctx.options.parallel_threshold)
+		return { make_child(ctx, begin, mid), make_child(ctx, mid, end) };
 
-	int axis = random_int(0, 2);
-	auto comparator =
-		(axis == 0) ? box_x_compare :
-		(axis == 1) ? box_y_compare :
-		              box_z_compare;
+	// The left subtree waits on this worker's deque for a thief while the right one is built here
+	std::shared_ptr<bvh_node> left_child;
+	task_group group;
+	ctx.options.pool->submit(group, [&] { left_child = make_child(ctx, begin, mid); });
+	auto right_child = make_child(ctx, mid, end);
+	ctx.options.pool->wait(group);
+	return { std::move(left_child), std::move(right_child) };
+}
+
+void bvh_node::build(build_context& ctx, size_t begin, size_t end) {
+	++ctx.nodes;
+	if (ctx.options.split == bvh_split::sah)
+		build_sah(ctx, begin, end);
+	else
+		build_median(ctx, begin, end);
+	// Nested hierarchies among the objects count as nodes too
+	left_node = dynamic_cast<const bvh_node*>(left.get());
+	right_node = dynamic_cast<const bvh_node*>(right.get());
+}
 
-	size_t span = end - start;
+void bvh_node::build_median(build_context& ctx, size_t begin, size_t end) {
+	// Seeded by the range rather than a shared generator, so the tree doesn't depend on the thread count
+	axis = static_cast<int>(sampler(begin ^ (static_cast<uint64_t>(end) << 32)).next() % 3);
+	size_t span = end - begin;
+	const auto& refs = ctx.refs;
 
 	if (span <= 3) {
-		left = objects[start]; // Order doesn't really matter here
+		// Three objects become one object plus a child node holding the other two
+		if (span < 3) ++ctx.leaves;
+		ctx.leaf_objects += span < 3 ? span : 1;
+		left = ctx.objects[refs[begin].object]; // Order doesn't really matter here
+		box = refs[begin].box;
 		if (span == 1)
 			right = left;
-		else if (span == 2)
-			right = objects[start + 1];
-		else
-			right = std::make_shared<bvh_node>(objects, start + 1, end, time0, time1);
+		else if (span == 2) {
+			right = ctx.objects[refs[begin + 1].object];
+			box = surrounding_box(box, refs[begin + 1].box);
+		}
+		else {
+			auto child = make_child(ctx, begin + 1, end);
+			box = surrounding_box(box, child->box);
+			right = std::move(child);
+		}
+		return;
 	}
+
+	auto mid = begin + span / 2;
+	std::nth_element(ctx.refs.begin() + begin, ctx.refs.begin() + mid, ctx.refs.begin() + end, [&](const bvh_reference& a, const bvh_reference& b) {
+		return a.centroid[axis] < b.centroid[axis];
+	});
+	auto [left_child, right_child] = make_children(ctx, begin, mid, end);
+	box = surrounding_box(left_child->box, right_child->box);
+	left = std::move(left_child);
+	right = std::move(right_child);
+}
+
+void bvh_node::build_sah(build_context& ctx, size_t begin, size_t end) {
+	const auto& options = ctx.options;
+	size_t span = end - begin;
+
+	const auto& refs = ctx.refs;
+
+	box = refs[begin].box;
+	if (span == 1) {
+		++ctx.leaves;
+		++ctx.leaf_objects;
+		left = right = ctx.objects[refs[begin].object];
+		return;
+	}
+
+	// Large ranges are bounded and binned in chunks on the pool, min/max and counts merge exactly
+	const size_t chunks = ctx.chunks(span);
+	auto grow_bounds = [&](size_t lo, size_t hi, sah_bin* bounds) {
+		for (size_t i = lo; i < hi; ++i) {
+			bounds[0].grow(refs[i].box);
+			bounds[1].grow(aabb(refs[i].centroid, refs[i].centroid));
+		}
+	};
+	sah_bin bounds[2] = { sah_bin::empty(), sah_bin::empty() };
+	if (chunks == 1)
+		grow_bounds(begin, end, bounds);
+	else {
+		std::vector<sah_bin> partial(2 * chunks, sah_bin::empty());
+		ctx.for_chunks(begin, end, chunks, [&](size_t c, size_t lo, size_t hi) { grow_bounds(lo, hi, &partial[2 * c]); });
+		for (size_t c = 0; c < chunks; ++c) {
+			bounds[0].merge(partial[2 * c]);
+			bounds[1].merge(partial[2 * c + 1]);
+		}
+	}
+	box = bounds[0].box();
+	const aabb centroids = bounds[1].box();
+
+	constexpr int max_bins = sah_bins::max_bins;
+	// Small ranges get fewer bins, most of them would stay empty anyway
+	const int bin_count = static_cast<int>(std::clamp<size_t>(std::min<size_t>(options.bin_count, 2 * span), 2, max_bins));
+	double scale[3];
+	for (int a = 0; a < 3; ++a) {
+		auto extent = centroids.max()[a] - centroids.min()[a];
+		scale[a] = extent > 0 ? bin_count / extent : 0.0;
+	}
+	auto bin_index = [&](const vec3& centroid, int a) {
+		auto index = static_cast<int>(scale[a] * (centroid[a] - centroids.min()[a]));
+		return std::min(index, bin_count - 1);
+	};
+
+	// Bin all three axes in one pass over the objects
+	auto bin_range = [&](size_t lo, size_t hi, sah_bins& result) {
+		for (auto& axis_bins : result.axis)
+			std::fill(axis_bins, axis_bins + bin_count, sah_bin::empty());
+		for (size_t i = lo; i < hi; ++i)
+			for (int a = 0; a < 3; ++a)
+				result.axis[a][bin_index(refs[i].centroid, a)].grow(refs[i].box);
+	};
+	sah_bins binned;
+	if (chunks == 1)
+		bin_range(begin, end, binned);
 	else {
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
-		auto mid = start + span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		std::vector<sah_bins> partial(chunks);
+		ctx.for_chunks(begin, end, chunks, [&](size_t c, size_t lo, size_t hi) { bin_range(lo, hi, partial[c]); });
+		binned = partial[0];
+		for (size_t c = 1; c < chunks; ++c)
+			for (int a = 0; a < 3; ++a)
+				for (int b = 0; b < bin_count; ++b)
+					binned.axis[a][b].merge(partial[c].axis[a][b]);
+	}
+	const auto& bins = binned.axis;
+
+	// Sweep every axis, keep the cheapest split plane between two bins
+	double best_cost = infinity;
+	int best_axis = -1;
+	int best_split = 0;
+	for (int a = 0; a < 3; ++a) {
+		if (scale[a] == 0) continue;
+
+		double right_area[max_bins];
+		size_t right_count[max_bins];
+		auto accumulated = sah_bin::empty();
+		for (int b = bin_count - 1; b > 0; --b) {
+			accumulated.merge(bins[a][b]);
+			right_area[b] = accumulated.area();
+			right_count[b] = accumulated.count;
+		}
+
+		accumulated = sah_bin::empty();
+		for (int split = 1; split < bin_count; ++split) {
+			accumulated.merge(bins[a][split - 1]);
+			if (accumulated.count == 0 || right_count[split] == 0) continue;
+			auto cost = options.traversal_cost + options.intersection_cost *
+				(accumulated.area() * accumulated.count + right_area[split] * right_count[split]) / box.surface_area();
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = a;
+				best_split = split;
+			}
+		}
 	}
 
-	auto box_left = left->bounding_box(time0, time1);
-	auto box_right = right->bounding_box(time0, time1);
-	if (!box_left || !box_right) std::cerr << "No bounding box in bvh_node constructor.\n";
+	auto leaf_cost = options.intersection_cost * span;
+	if (span <= options.max_leaf_size && (best_axis < 0 || leaf_cost <= best_cost)) {
+		++ctx.leaves;
+		ctx.leaf_objects += span;
+		// Two objects fit in left/right, only larger leaves need their own list
+		if (span == 2) {
+			left = ctx.objects[refs[begin].object];
+			right = ctx.objects[refs[begin + 1].object];
+			return;
+		}
+		leaf.reserve(span);
+		for (size_t i = begin; i < end; ++i)
+			leaf.push_back(ctx.objects[refs[i].object]);
+		return;
+	}
 
-	box = surrounding_box(box_left.value(), box_right.value());
+	size_t mid;
+	if (best_axis < 0) {
+		// Every centroid coincides, any split is as good as another
+		mid = begin + span / 2;
+	}
+	else {
+		auto middle = std::partition(ctx.refs.begin() + begin, ctx.refs.begin() + end, [&](const bvh_reference& ref) {
+			return bin_index(ref.centroid, best_axis) < best_split;
+		});
+		mid = middle - ctx.refs.begin();
+	}
+	axis = std::max(best_axis, 0);
+	std::tie(left, right) = make_children(ctx, begin, mid, end);
 }
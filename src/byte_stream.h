@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Little-endian encoding of the binary files and messages, independent of the host
+
+inline void put_u32(std::string& out, uint32_t value) {
+	for (int b = 0; b < 4; ++b)
+		out += static_cast<char>(value >> (8 * b));
+}
+
+inline void put_u64(std::string& out, uint64_t value) {
+	for (int b = 0; b < 8; ++b)
+		out += static_cast<char>(value >> (8 * b));
+}
+
+inline void put_f64(std::string& out, double value) {
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	put_u64(out, bits);
+}
+
+inline void put_string(std::string& out, const std::string& value) {
+	put_u32(out, static_cast<uint32_t>(value.size()));
+	out += value;
+}
+
+// Reads fields in order, failing once anything runs past the end
+class byte_reader {
+public:
+	explicit byte_reader(const std::string& data) : data(data) {}
+
+	bool ok() const { return good; }
+	bool at_end() const { return offset == data.size(); }
+
+	uint64_t u64(int bytes = 8) {
+		if (!good || data.size() - offset < size_t(bytes)) {
+			good = false;
+			return 0;
+		}
+		uint64_t value = 0;
+		for (int b = 0; b < bytes; ++b)
+			value |= uint64_t(static_cast<uint8_t>(data[offset++])) << (8 * b);
+		return value;
+	}
+
+	uint32_t u32() { return static_cast<uint32_t>(u64(4)); }
+
+	double f64() {
+		auto bits = u64();
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	std::string bytes(size_t count) {
+		if (!good || data.size() - offset < count) {
+			good = false;
+			return {};
+		}
+		offset += count;
+		return data.substr(offset - count, count);
+	}
+
+	std::string string() { return bytes(u32()); }
+
+private:
+	const std::string& data;
+	size_t offset = 0;
+	bool good = true;
+};
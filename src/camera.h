@@ -34,13 +34,13 @@ public:
 		t1 = time1;
 	}
 
-	ray get_ray(double s, double t) const {
-		vec3 rd = lens_radius * random_in_unit_disk();
+	ray get_ray(double s, double t, sampler& rng) const {
+		vec3 rd = lens_radius * random_in_unit_disk(rng);
 		vec3 offset = u * rd.x() + v * rd.y();
 		return ray(
 			origin + offset,
 			lower_left_corner + s * horizontal + t * vertical - origin - offset,
-			random_double(t0, t1)
+			rng.next_double(t0, t1)
 		);
 	}
 
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+
+#include "renderer.h"
+#include "image_io.h"
+#include "byte_stream.h"
+
+// A render in progress as saved to disk: the scene, the settings that shape the image and
+// the render_state. Sums are kept as doubles so a resumed render adds its samples to
+// exactly the values an uninterrupted one would have, and ends bit-identical to it.
+// Finished renders are saved the same way as accumulation files for raytracer_merge.
+struct checkpoint {
+	std::string scene;
+	render_settings settings;
+	render_state state;
+};
+
+namespace checkpoint_detail {
+
+	// "RTCK" and a version, then everything little-endian
+	constexpr char magic[4] = { 'R', 'T', 'C', 'K' };
+	constexpr uint32_t version = 3;
+
+}
+
+// The scene and the settings that shape the image, shared by checkpoints and tile server jobs
+void put_frame(std::string& out, const std::string& scene, const render_settings& s) {
+	put_string(out, scene);
+	put_u32(out, s.width);
+	put_u32(out, s.height);
+	put_u32(out, s.samples_per_pixel);
+	put_u32(out, s.first_sample);
+	put_u32(out, s.max_depth);
+	put_u32(out, s.rr_depth);
+	put_u32(out, (s.sample_lights ? 1 : 0) | (s.progressive ? 2 : 0));
+	put_f64(out, s.ao_radius);
+	put_f64(out, s.adaptive_threshold);
+	put_u32(out, s.adaptive_pass);
+	put_u64(out, s.seed);
+}
+
+// False when the fields ran out or describe no sensible frame
+bool read_frame(byte_reader& in, std::string& scene, render_settings& s) {
+	scene = in.string();
+	s.width = static_cast<int>(in.u32());
+	s.height = static_cast<int>(in.u32());
+	s.samples_per_pixel = static_cast<int>(in.u32());
+	s.first_sample = static_cast<int>(in.u32());
+	s.max_depth = static_cast<int>(in.u32());
+	s.rr_depth = static_cast<int>(in.u32());
+	auto flags = in.u32();
+	s.sample_lights = flags & 1;
+	s.progressive = flags & 2;
+	s.ao_radius = in.f64();
+	s.adaptive_threshold = in.f64();
+	s.adaptive_pass = static_cast<int>(in.u32());
+	s.seed = in.u64();
+	return in.ok() && s.width > 0 && s.height > 0 && size_t(s.width) * s.height <= (size_t(1) << 28) && s.samples_per_pixel > 0;
+}
+
+// How the frame is traced, for checkpoints and tile server jobs. These choices leave the
+// image's expected value alone, but media draw their distances in traversal order, so a
+// resumed render and every worker of a frame must trace it the same way for the image to
+// match a single uninterrupted process's.
+void put_tracing(std::string& out, const render_settings& s) {
+	put_u32(out, static_cast<uint32_t>(s.bvh));
+	put_u32(out, s.packet_size);
+	put_u32(out, static_cast<uint32_t>(s.integrator));
+	put_u32(out, s.wavefront_batch);
+	put_u32(out, s.reorder_rays ? 1 : 0);
+}
+
+bool read_tracing(byte_reader& in, render_settings& s) {
+	auto layout = in.u32();
+	s.packet_size = static_cast<int>(in.u32());
+	auto integrator = in.u32();
+	s.wavefront_batch = static_cast<int>(in.u32());
+	s.reorder_rays = in.u32() != 0;
+	if (!in.ok() || layout > static_cast<uint32_t>(bvh_layout::wide8) || integrator > static_cast<uint32_t>(render_integrator::wavefront)) return false;
+	s.bvh = static_cast<bvh_layout>(layout);
+	s.integrator = static_cast<render_integrator>(integrator);
+	return (s.packet_size == 0 || s.packet_size == 8 || s.packet_size == 16) && s.wavefront_batch > 0;
+}
+
+std::string encode_checkpoint(const std::string& scene, const render_settings& s, const render_state& state) {
+	using namespace checkpoint_detail;
+	const auto& buffer = state.buffer;
+	const bool adaptive = s.adaptive_threshold > 0;
+
+	std::string out(magic, sizeof(magic));
+	put_u32(out, version);
+	put_frame(out, scene, s);
+	put_tracing(out, s);
+	put_u32(out, state.pass);
+	put_u32(out, state.active.empty() ? 0 : 1);
+
+	out.reserve(out.size() + buffer.counts.size() * (adaptive ? 45 : 28));
+	for (auto count : buffer.counts)
+		put_u32(out, count);
+	for (const auto& sum : buffer.sums)
+		for (int c = 0; c < 3; ++c)
+			put_f64(out, sum[c]);
+	if (adaptive)
+		for (auto m2 : buffer.m2)
+			put_f64(out, m2);
+	for (auto active : state.active)
+		out += static_cast<char>(active);
+	return out;
+}
+
+std::optional<checkpoint> decode_checkpoint(const std::string& data) {
+	using namespace checkpoint_detail;
+	byte_reader in(data);
+	if (in.bytes(sizeof(magic)) != std::string(magic, sizeof(magic)) || in.u32() != version) {
+		std::cerr << "ERROR: Not a version " << version << " render checkpoint.\n";
+		return std::nullopt;
+	}
+
+	checkpoint saved;
+	auto& s = saved.settings;
+	bool valid = read_frame(in, saved.scene, s) && read_tracing(in, s);
+	saved.state.pass = static_cast<int>(in.u32());
+	bool has_mask = in.u32() != 0;
+	if (!valid || !in.ok()) {
+		std::cerr << "ERROR: Corrupt render checkpoint header.\n";
+		return std::nullopt;
+	}
+
+	auto& buffer = saved.state.buffer;
+	buffer.reset(s.width, s.height);
+	for (auto& count : buffer.counts)
+		count = in.u32();
+	for (auto& sum : buffer.sums)
+		for (int c = 0; c < 3; ++c)
+			sum[c] = in.f64();
+	if (s.adaptive_threshold > 0)
+		for (auto& m2 : buffer.m2)
+			m2 = in.f64();
+	if (has_mask) {
+		auto mask = in.bytes(buffer.counts.size());
+		saved.state.active.assign(mask.begin(), mask.end());
+	}
+	if (!in.ok() || !in.at_end()) {
+		std::cerr << "ERROR: Truncated or corrupt render checkpoint.\n";
+		return std::nullopt;
+	}
+	return saved;
+}
+
+bool save_checkpoint(const std::string& path, const std::string& scene, const render_settings& settings, const render_state& state) {
+	return replace_file(path, encode_checkpoint(scene, settings, state));
+}
+
+std::optional<checkpoint> load_checkpoint(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		std::cerr << "ERROR: Could not open checkpoint " << path << ".\n";
+		return std::nullopt;
+	}
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return decode_checkpoint(data);
+}
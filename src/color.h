@@ -1,21 +1,19 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 
 #include "vec3.h"
 #include "common.h"
 
-void write_color(std::ostream& out, color pixel_color, int samples_per_pixel) {
-	auto r = pixel_color.x();
-	auto g = pixel_color.y();
-	auto b = pixel_color.z();
+// Averages the samples of one channel, applies gamma 2 and quantizes to 0..255
+inline uint8_t to_byte(double component, double scale) {
+	return static_cast<uint8_t>(256 * clamp(std::sqrt(scale * component), 0.0, almost_one));
+}
 
+void write_color(std::ostream& out, color pixel_color, int samples_per_pixel) {
 	auto scale = 1.0 / samples_per_pixel;
-	r = std::sqrt(scale * r);
-	g = std::sqrt(scale * g);
-	b = std::sqrt(scale * b);
-
-	out << static_cast<int>(256 * clamp(r, 0.0, almost_one)) << '\t'
-		<< static_cast<int>(256 * clamp(g, 0.0, almost_one)) << '\t'
-		<< static_cast<int>(256 * clamp(b, 0.0, almost_one)) << '\n';
+	out << static_cast<int>(to_byte(pixel_color.x(), scale)) << '\t'
+		<< static_cast<int>(to_byte(pixel_color.y(), scale)) << '\t'
+		<< static_cast<int>(to_byte(pixel_color.z(), scale)) << '\n';
 }
@@ -7,6 +7,12 @@
 #include "ray.h"
 #include "vec3.h"
 
+// x86-64 always has SSE2, wider instruction sets are checked at run time
+#if defined(__x86_64__) || defined(_M_X64)
+#define RAYTRACER_X86 1
+#include <immintrin.h>
+#endif
+
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 const double almost_one = std::nextafter(1.0, 0.0);
@@ -8,40 +8,49 @@
 
 class constant_medium : public visible {
 public:
-	constant_medium(std::shared_ptr<visible> boundary, double density, std::shared_ptr<texture> albedo)
-		: convex(boundary), neg_inv_density(-1 / density), phase_function(std::make_shared<isotropic>(albedo)) {}
-	constant_medium(std::shared_ptr<visible> boundary, double density, vec3 color)
-		: convex(boundary), neg_inv_density(-1 / density), phase_function(std::make_shared<isotropic>(color)) {}
+	// `phase` is usually an isotropic material from the scene's table
+	constant_medium(std::shared_ptr<visible> boundary, double density, const material* phase)
+		: convex(boundary), neg_inv_density(-1 / density), phase_function(phase) {}
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override {
 		return convex->bounding_box(time0, time1);
 	}
+	hit surface(const ray& r, const intersection& isect, int level) const override;
+	primitive_type type() const override { return primitive_type::constant_medium; }
 
 private:
 	std::shared_ptr<visible> convex;
 	double neg_inv_density;
-	std::shared_ptr<material> phase_function;
+	const material* phase_function;
 };
 
-std::optional<hit> constant_medium::hit_check(const ray& r, double t_min, double t_max) const {
-	auto rec1 = convex->hit_check(r, -infinity, infinity);
-	if (!rec1) return std::nullopt;
-	auto rec2 = convex->hit_check(r, rec1->t + 0.0001, infinity);
-	if (!rec2) return std::nullopt;
+bool constant_medium::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
+	// Only the distances matter for the boundary, its surface is never computed
+	intersection rec1, rec2;
+	if (!convex->intersect(r, -infinity, infinity, rec1)) return false;
+	if (!convex->intersect(r, rec1.t + 0.0001, infinity, rec2)) return false;
 
-	if (rec1->t < t_min) rec1->t = t_min;
-	if (rec2->t > t_max) rec2->t = t_max;
-	if (rec1->t < 0) rec1->t = 0;
-	if (rec1->t >= rec2->t) return std::nullopt;
+	if (rec1.t < t_min) rec1.t = t_min;
+	if (rec2.t > t_max) rec2.t = t_max;
+	if (rec1.t < 0) rec1.t = 0;
+	if (rec1.t >= rec2.t) return false;
 
 	const auto ray_length = r.direction().length();
-	const auto distance_inside_boundary = (rec2->t - rec1->t) * ray_length;
-	const auto hit_distance = neg_inv_density * log(random_double());
-	if (hit_distance > distance_inside_boundary) return std::nullopt;
+	const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+	// visible::intersect has no sampler parameter, so draw from the one the
+	// render thread bound for the current pixel sample
+	sampler& rng = *bound_sampler();
+	const auto hit_distance = neg_inv_density * log(rng.next_double());
+	if (hit_distance > distance_inside_boundary) return false;
+
+	isect.record(rec1.t + hit_distance / ray_length, this);
+	return true;
+}
 
+hit constant_medium::surface(const ray& r, const intersection& isect, int level) const {
 	hit rec;
-	rec.t = rec1->t + hit_distance / ray_length;
+	rec.t = isect.t;
 	rec.point = r.at(rec.t);
 	rec.normal = vec3{ 1,0,0 };// random_in_unit_sphere();
 	rec.front_face = true; // Arbitrary
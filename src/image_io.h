@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "color.h"
+#include "thread_pool.h"
+
+enum class image_format {
+	ppm_text, // P3, one line of text per pixel
+	ppm,      // P6, 8 bits per channel
+	pfm,      // Linear 32-bit floats before gamma and quantization, for compositing
+	png,      // 8 bits per channel, deflate compressed
+};
+
+std::optional<image_format> image_format_from_name(const std::string& name) {
+	if (name == "p3") return image_format::ppm_text;
+	if (name == "ppm" || name == "p6") return image_format::ppm;
+	if (name == "pfm") return image_format::pfm;
+	if (name == "png") return image_format::png;
+	return std::nullopt;
+}
+
+// Guesses the format from a file name's extension
+std::optional<image_format> image_format_from_path(const std::string& path) {
+	auto dot = path.rfind('.');
+	if (dot == std::string::npos) return std::nullopt;
+	auto extension = path.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	return image_format_from_name(extension);
+}
+
+// A framebuffer of accumulated sample sums, top row first
+struct framebuffer_view {
+	const color* pixels;
+	int width;
+	int height;
+	int samples_per_pixel;
+	const uint32_t* sample_counts = nullptr; // Per pixel when they differ, overrides samples_per_pixel
+
+	// Turns pixel i's sum into its average
+	double scale(size_t i) const {
+		if (!sample_counts) return 1.0 / samples_per_pixel;
+		return sample_counts[i] > 0 ? 1.0 / sample_counts[i] : 0.0;
+	}
+};
+
+namespace image_io_detail {
+
+	inline int row_band_count(thread_pool* pool, int rows) {
+		if (!pool || pool->size() == 1 || rows < 64) return 1;
+		return static_cast<int>(std::min<size_t>(rows / 16, 4 * pool->size()));
+	}
+
+	// Runs fn(band, row_begin, row_end) over row_band_count() bands of rows, as pool tasks when there are several
+	template <typename F>
+	void for_row_bands(thread_pool* pool, int rows, F fn) {
+		const int bands = row_band_count(pool, rows);
+		if (bands == 1) {
+			fn(0, 0, rows);
+			return;
+		}
+		task_group group;
+		for (int b = 0; b < bands; ++b)
+			pool->submit(group, [&, b] { fn(b, rows * b / bands, rows * (b + 1) / bands); }, b);
+		pool->wait(group);
+	}
+
+	inline void put_be32(std::string& out, uint32_t value) {
+		out.push_back(static_cast<char>(value >> 24));
+		out.push_back(static_cast<char>(value >> 16));
+		out.push_back(static_cast<char>(value >> 8));
+		out.push_back(static_cast<char>(value));
+	}
+
+	inline uint32_t crc32(const char* data, size_t size, uint32_t crc = 0) {
+		static const auto table = [] {
+			std::array<uint32_t, 256> t{};
+			for (uint32_t n = 0; n < 256; ++n) {
+				uint32_t c = n;
+				for (int k = 0; k < 8; ++k)
+					c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				t[n] = c;
+			}
+			return t;
+		}();
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline uint32_t adler32(const uint8_t* data, size_t size) {
+		uint32_t a = 1, b = 0;
+		while (size > 0) {
+			// 5552 bytes is the longest run before the sums can overflow
+			size_t run = std::min<size_t>(size, 5552);
+			for (size_t i = 0; i < run; ++i) {
+				a += data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += run;
+			size -= run;
+		}
+		return (b << 16) | a;
+	}
+
+	// LSB-first bit writer as deflate wants it
+	class bit_writer {
+	public:
+		explicit bit_writer(std::string& out) : out(out) {}
+
+		void bits(uint32_t value, int count) {
+			buffer |= static_cast<uint64_t>(value) << filled;
+			filled += count;
+			while (filled >= 8) {
+				out.push_back(static_cast<char>(buffer & 0xff));
+				buffer >>= 8;
+				filled -= 8;
+			}
+		}
+
+		// Huffman codes are defined MSB first
+		void code(uint32_t value, int count) {
+			uint32_t reversed = 0;
+			for (int i = 0; i < count; ++i)
+				reversed |= ((value >> i) & 1) << (count - 1 - i);
+			bits(reversed, count);
+		}
+
+		void align() {
+			if (filled > 0) bits(0, 8 - filled);
+		}
+
+	private:
+		std::string& out;
+		uint64_t buffer = 0;
+		int filled = 0;
+	};
+
+	inline void fixed_literal(bit_writer& w, int symbol) {
+		if (symbol < 144) w.code(0x30 + symbol, 8);
+		else if (symbol < 256) w.code(0x190 + symbol - 144, 9);
+		else if (symbol < 280) w.code(symbol - 256, 7);
+		else w.code(0xc0 + symbol - 280, 8);
+	}
+
+	constexpr int length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	constexpr int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	constexpr int distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	constexpr int distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	inline void fixed_match(bit_writer& w, int length, int distance) {
+		int l = 28;
+		while (length_base[l] > length) --l;
+		fixed_literal(w, 257 + l);
+		w.bits(length - length_base[l], length_extra[l]);
+		int d = 29;
+		while (distance_base[d] > distance) --d;
+		w.code(d, 5);
+		w.bits(distance - distance_base[d], distance_extra[d]);
+	}
+
+	// Compresses one independent piece of a deflate stream with fixed Huffman
+	// codes and hash-chain matching. Pieces never refer back into each other and
+	// end byte aligned, so they can be produced in parallel and concatenated.
+	inline std::string deflate_piece(const uint8_t* data, size_t size, bool last) {
+		constexpr int window = 32768;
+		constexpr int hash_bits = 15;
+		constexpr int max_chain = 32;
+		constexpr int min_match = 3;
+		constexpr int max_match = 258;
+
+		std::string out;
+		out.reserve(size / 2 + 64);
+		bit_writer w(out);
+		w.bits(last ? 1 : 0, 1);
+		w.bits(1, 2); // Fixed Huffman block
+
+		std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+		std::vector<int32_t> prev(size);
+		auto hash = [&](size_t i) {
+			uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+			return (v * 2654435761u) >> (32 - hash_bits);
+		};
+		auto insert = [&](size_t i) {
+			if (i + min_match > size) return;
+			auto h = hash(i);
+			prev[i] = head[h];
+			head[h] = static_cast<int32_t>(i);
+		};
+
+		size_t i = 0;
+		while (i < size) {
+			int best_length = 0, best_distance = 0;
+			if (i + min_match <= size) {
+				auto limit = static_cast<int>(std::min<size_t>(max_match, size - i));
+				int32_t candidate = head[hash(i)];
+				for (int chain = 0; candidate >= 0 && chain < max_chain && i - candidate <= window; ++chain) {
+					int length = 0;
+					while (length < limit && data[candidate + length] == data[i + length]) ++length;
+					if (length > best_length) {
+						best_length = length;
+						best_distance = static_cast<int>(i - candidate);
+						if (length == limit) break;
+					}
+					candidate = prev[candidate];
+				}
+			}
+			if (best_length >= min_match) {
+				fixed_match(w, best_length, best_distance);
+				for (int k = 0; k < best_length; ++k) insert(i + k);
+				i += best_length;
+			}
+			else {
+				fixed_literal(w, data[i]);
+				insert(i);
+				++i;
+			}
+		}
+		fixed_literal(w, 256); // End of block
+
+		if (!last) {
+			// Empty stored block, the same byte alignment trick as a zlib sync flush
+			w.bits(0, 3);
+			w.align();
+			out.append("\x00\x00\xff\xff", 4);
+		}
+		w.align();
+		return out;
+	}
+
+	inline int paeth(int a, int b, int c) {
+		int p = a + b - c;
+		int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc) return a;
+		return pb <= pc ? b : c;
+	}
+
+	// Picks the PNG filter with the smallest sum of absolute differences, the usual heuristic
+	inline void filter_row(const uint8_t* row, const uint8_t* above, size_t stride, uint8_t* out) {
+		constexpr int bpp = 3;
+		std::vector<uint8_t> candidate(stride);
+		uint64_t best_score = UINT64_MAX;
+		for (uint8_t type = 0; type < 5; ++type) {
+			uint64_t score = 0;
+			for (size_t x = 0; x < stride; ++x) {
+				int a = x >= bpp ? row[x - bpp] : 0;
+				int b = above ? above[x] : 0;
+				int c = above && x >= bpp ? above[x - bpp] : 0;
+				int predicted = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+				candidate[x] = static_cast<uint8_t>(row[x] - predicted);
+				score += std::abs(static_cast<int8_t>(candidate[x]));
+			}
+			if (score < best_score) {
+				best_score = score;
+				out[0] = type;
+				std::memcpy(out + 1, candidate.data(), stride);
+			}
+		}
+	}
+
+	inline void png_chunk(std::string& out, const char* type, const std::string& data) {
+		put_be32(out, static_cast<uint32_t>(data.size()));
+		auto start = out.size();
+		out.append(type, 4);
+		out += data;
+		put_be32(out, crc32(out.data() + start, out.size() - start));
+	}
+
+	std::vector<uint8_t> to_rgb8(const framebuffer_view& image, thread_pool* pool) {
+		std::vector<uint8_t> rgb(size_t(image.width) * image.height * 3);
+		for_row_bands(pool, image.height, [&](int, int y0, int y1) {
+			for (size_t i = size_t(y0) * image.width; i < size_t(y1) * image.width; ++i)
+				for (int c = 0; c < 3; ++c)
+					rgb[3 * i + c] = to_byte(image.pixels[i][c], image.scale(i));
+		});
+		return rgb;
+	}
+
+	std::string encode_ppm_text(const framebuffer_view& image, thread_pool* pool) {
+		auto rgb = to_rgb8(image, pool);
+		std::vector<std::string> bands(image.height);
+		for_row_bands(pool, image.height, [&](int, int y0, int y1) {
+			for (int y = y0; y < y1; ++y) {
+				auto& text = bands[y];
+				text.reserve(size_t(image.width) * 12);
+				char line[16];
+				for (size_t i = size_t(y) * image.width * 3; i < size_t(y + 1) * image.width * 3; i += 3) {
+					int n = std::snprintf(line, sizeof(line), "%d\t%d\t%d\n", rgb[i], rgb[i + 1], rgb[i + 2]);
+					text.append(line, n);
+				}
+			}
+		});
+		std::string out = "P3\n" + std::to_string(image.width) + ' ' + std::to_string(image.height) + "\n255\n";
+		for (const auto& band : bands)
+			out += band;
+		return out;
+	}
+
+	std::string encode_ppm(const framebuffer_view& image, thread_pool* pool) {
+		auto rgb = to_rgb8(image, pool);
+		std::string out = "P6\n" + std::to_string(image.width) + ' ' + std::to_string(image.height) + "\n255\n";
+		out.append(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+		return out;
+	}
+
+	std::string encode_pfm(const framebuffer_view& image, thread_pool* pool) {
+		// A negative scale marks little-endian data, rows go bottom to top
+		std::string out = "PF\n" + std::to_string(image.width) + ' ' + std::to_string(image.height) + "\n-1.0\n";
+		auto header = out.size();
+		const size_t row_bytes = size_t(image.width) * 3 * sizeof(float);
+		out.resize(header + row_bytes * image.height);
+		for_row_bands(pool, image.height, [&](int, int y0, int y1) {
+			for (int y = y0; y < y1; ++y) {
+				auto* row = out.data() + header + row_bytes * (image.height - 1 - y);
+				for (int x = 0; x < image.width; ++x)
+					for (int c = 0; c < 3; ++c) {
+						auto i = size_t(y) * image.width + x;
+						auto value = static_cast<float>(image.scale(i) * image.pixels[i][c]);
+						uint32_t bits;
+						std::memcpy(&bits, &value, sizeof(bits));
+						for (int b = 0; b < 4; ++b)
+							row[(3 * x + c) * 4 + b] = static_cast<char>(bits >> (8 * b));
+					}
+			}
+		});
+		return out;
+	}
+
+	std::string encode_png(const framebuffer_view& image, thread_pool* pool) {
+		auto rgb = to_rgb8(image, pool);
+		const size_t stride = size_t(image.width) * 3;
+
+		// Filtered scanlines, each prefixed with its filter type
+		std::vector<uint8_t> filtered((stride + 1) * image.height);
+		for_row_bands(pool, image.height, [&](int, int y0, int y1) {
+			for (int y = y0; y < y1; ++y)
+				filter_row(&rgb[stride * y], y > 0 ? &rgb[stride * (y - 1)] : nullptr, stride, &filtered[(stride + 1) * y]);
+		});
+
+		// Bands of scanlines compress independently and are concatenated in order
+		std::vector<std::string> pieces(row_band_count(pool, image.height));
+		for_row_bands(pool, image.height, [&](int band, int y0, int y1) {
+			auto begin = (stride + 1) * y0;
+			auto end = (stride + 1) * y1;
+			pieces[band] = deflate_piece(filtered.data() + begin, end - begin, band + 1 == static_cast<int>(pieces.size()));
+		});
+
+		std::string zlib = "\x78\x01";
+		for (const auto& piece : pieces)
+			zlib += piece;
+		put_be32(zlib, adler32(filtered.data(), filtered.size()));
+
+		std::string header;
+		put_be32(header, image.width);
+		put_be32(header, image.height);
+		header.append("\x08\x02\x00\x00\x00", 5); // 8 bit RGB, deflate, adaptive filtering, no interlace
+
+		std::string out = "\x89PNG\r\n\x1a\n";
+		png_chunk(out, "IHDR", header);
+		png_chunk(out, "IDAT", zlib);
+		png_chunk(out, "IEND", {});
+		return out;
+	}
+}
+
+// Encodes the whole image in memory, converting rows on the pool
+std::string encode_image(image_format format, const framebuffer_view& image, thread_pool* pool = nullptr) {
+	using namespace image_io_detail;
+	switch (format) {
+	case image_format::ppm_text: return encode_ppm_text(image, pool);
+	case image_format::ppm: return encode_ppm(image, pool);
+	case image_format::pfm: return encode_pfm(image, pool);
+	case image_format::png: return encode_png(image, pool);
+	}
+	return {};
+}
+
+// Writes `data` with a single call, "-" writes to stdout
+bool write_file(const std::string& path, const std::string& data) {
+	FILE* file = stdout;
+	if (path == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+	else if (!(file = std::fopen(path.c_str(), "wb"))) {
+		std::cerr << "ERROR: Could not open " << path << " for writing.\n";
+		return false;
+	}
+	bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+	written = (file == stdout ? std::fflush(file) : std::fclose(file)) == 0 && written;
+	if (!written) std::cerr << "ERROR: Could not write " << path << ".\n";
+	return written;
+}
+
+// Writes through `path`.partial and a rename, so readers see either the old file or the new one
+bool replace_file(const std::string& path, const std::string& data) {
+	auto partial = path + ".partial";
+	if (!write_file(partial, data)) return false;
+	std::error_code error;
+	std::filesystem::rename(partial, path, error);
+	if (error) {
+		std::cerr << "ERROR: Could not replace " << path << ": " << error.message() << ".\n";
+		return false;
+	}
+	return true;
+}
+
+bool write_image(const std::string& path, image_format format, const framebuffer_view& image, thread_pool* pool = nullptr) {
+	return write_file(path, encode_image(format, image, pool));
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "bvh.h"
+#include "render_counters.h"
+
+// 32 bytes, two nodes per cache line. Interior nodes keep their first child
+// right after them and `offset` points at the second one; leaves use `offset`
+// as the index of their first primitive.
+struct linear_bvh_node {
+	float bounds[2][3];
+	uint32_t offset;
+	uint16_t count; // Primitives in a leaf, 0 for interior nodes
+	uint8_t axis;   // Split axis of interior nodes
+	uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32);
+
+// Depth-first array form of a built bvh_node, traversed iteratively.
+// Nested bvh_nodes among the objects are inlined into the same array.
+class linear_bvh final : public visible {
+public:
+	explicit linear_bvh(const bvh_node& root);
+
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	bool occluded(const ray& r, double t_min, double t_max) const override;
+	void intersect_packet(ray_packet& packet, int first, int last, const uint8_t* active) const override;
+	std::optional<aabb> bounding_box(double time0, double time1) const override { return box; }
+
+	size_t node_count() const { return nodes.size(); }
+	size_t primitive_count() const { return primitives.size(); }
+
+	// For layouts built from this one, such as wide_bvh
+	const std::vector<linear_bvh_node>& node_array() const { return nodes; }
+	const std::vector<const visible*>& primitive_array() const { return primitives; }
+	const std::vector<std::shared_ptr<visible>>& primitive_owners() const { return owners; }
+
+private:
+	static constexpr int max_depth = 64;
+
+	uint32_t flatten_node(const bvh_node& node, int depth);
+	uint32_t flatten_objects(const std::vector<std::shared_ptr<visible>>& objects, int depth);
+	uint32_t flatten_group(const std::vector<std::shared_ptr<visible>>& plain, const std::vector<const bvh_node*>& nested, size_t next, int depth);
+	uint32_t make_leaf(const std::vector<std::shared_ptr<visible>>& objects);
+	void set_bounds(uint32_t index, const aabb& bounds);
+	aabb node_box(uint32_t index) const;
+	bool node_hit(const linear_bvh_node& node, const traversal_ray& r, double t_min, double t_max) const;
+
+	std::vector<linear_bvh_node> nodes;
+	std::vector<const visible*> primitives;
+	std::vector<std::shared_ptr<visible>> owners; // Keeps the primitives alive once the bvh_node is gone
+	aabb box;
+	int tree_depth = 0;
+};
+
+linear_bvh::linear_bvh(const bvh_node& root) : box(root.box) {
+	flatten_node(root, 1);
+	if (tree_depth > max_depth) {
+		std::cerr << "ERROR: BVH depth " << tree_depth << " exceeds the traversal stack of " << max_depth << ".\n";
+		std::abort();
+	}
+}
+
+void linear_bvh::set_bounds(uint32_t index, const aabb& bounds) {
+	// Round outwards so the float box still contains the double one
+	for (int a = 0; a < 3; ++a) {
+		auto lo = static_cast<float>(bounds.min()[a]);
+		auto hi = static_cast<float>(bounds.max()[a]);
+		if (lo > bounds.min()[a]) lo = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+		if (hi < bounds.max()[a]) hi = std::nextafter(hi, std::numeric_limits<float>::infinity());
+		nodes[index].bounds[0][a] = lo;
+		nodes[index].bounds[1][a] = hi;
+	}
+}
+
+aabb linear_bvh::node_box(uint32_t index) const {
+	const auto& b = nodes[index].bounds;
+	return aabb(vec3(b[0][0], b[0][1], b[0][2]), vec3(b[1][0], b[1][1], b[1][2]));
+}
+
+uint32_t linear_bvh::make_leaf(const std::vector<std::shared_ptr<visible>>& objects) {
+	auto index = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(linear_bvh_node{});
+	nodes[index].offset = static_cast<uint32_t>(primitives.size());
+	nodes[index].count = static_cast<uint16_t>(objects.size());
+
+	aabb bounds = object_box(objects[0], 0, 1);
+	for (const auto& object : objects) {
+		bounds = surrounding_box(bounds, object_box(object, 0, 1));
+		primitives.push_back(object.get());
+		owners.push_back(object);
+	}
+	set_bounds(index, bounds);
+	return index;
+}
+
+uint32_t linear_bvh::flatten_objects(const std::vector<std::shared_ptr<visible>>& objects, int depth) {
+	// Plain primitives share one leaf, nested hierarchies are inlined as subtrees
+	std::vector<std::shared_ptr<visible>> plain;
+	std::vector<const bvh_node*> nested;
+	for (const auto& object : objects) {
+		if (auto node = dynamic_cast<const bvh_node*>(object.get()))
+			nested.push_back(node);
+		else
+			plain.push_back(object);
+	}
+	return flatten_group(plain, nested, 0, depth);
+}
+
+uint32_t linear_bvh::flatten_group(const std::vector<std::shared_ptr<visible>>& plain, const std::vector<const bvh_node*>& nested, size_t next, int depth) {
+	tree_depth = std::max(tree_depth, depth);
+	size_t remaining = nested.size() - next + (plain.empty() ? 0 : 1);
+	if (remaining == 1) return plain.empty() ? flatten_node(*nested[next], depth) : make_leaf(plain);
+
+	// Chain the parts together: the first one here, everything else behind `offset`
+	auto index = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(linear_bvh_node{});
+	if (plain.empty()) {
+		flatten_node(*nested[next], depth + 1);
+		nodes[index].offset = flatten_group(plain, nested, next + 1, depth + 1);
+	}
+	else {
+		make_leaf(plain);
+		nodes[index].offset = flatten_group({}, nested, next, depth + 1);
+	}
+	set_bounds(index, surrounding_box(node_box(index + 1), node_box(nodes[index].offset)));
+	return index;
+}
+
+uint32_t linear_bvh::flatten_node(const bvh_node& node, int depth) {
+	tree_depth = std::max(tree_depth, depth);
+	if (!node.leaf.empty()) return flatten_objects(node.leaf, depth);
+	if (node.left == node.right) return flatten_objects({ node.left }, depth);
+	if (node.holds_leaf()) return flatten_objects({ node.left, node.right }, depth);
+
+	auto index = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(linear_bvh_node{});
+	nodes[index].axis = static_cast<uint8_t>(node.axis);
+	flatten_objects({ node.left }, depth + 1);
+	nodes[index].offset = flatten_objects({ node.right }, depth + 1);
+	set_bounds(index, surrounding_box(node_box(index + 1), node_box(nodes[index].offset)));
+	return index;
+}
+
+inline bool linear_bvh::node_hit(const linear_bvh_node& node, const traversal_ray& r, double t_min, double t_max) const {
+	for (int a = 0; a < 3; ++a)
+		clip_slab(node.bounds[r.negative[a]][a], node.bounds[1 - r.negative[a]][a], r.origin[a], r.inv_direction[a], t_min, t_max);
+	return t_min < t_max;
+}
+
+bool linear_bvh::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
+	bool hit_anything = false;
+	const traversal_ray tr(r);
+
+	traversal_count count;
+	uint32_t stack[max_depth];
+	int top = 0;
+	uint32_t current = 0;
+	for (;;) {
+		const auto& node = nodes[current];
+		++count.nodes;
+		if (node_hit(node, tr, t_min, t_max)) {
+			if (node.count > 0) {
+				count.tests += node.count;
+				for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+					if (primitives[i]->intersect(r, t_min, t_max, isect)) {
+						t_max = isect.t;
+						hit_anything = true;
+					}
+				}
+			}
+			else {
+				// Descend into the child on the near side of the split first
+				if (tr.negative[node.axis]) {
+					stack[top++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[top++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+		if (top == 0) break;
+		current = stack[--top];
+	}
+	return hit_anything;
+}
+
+// Same traversal as intersect() without narrowing t_max, returns at the first primitive hit
+bool linear_bvh::occluded(const ray& r, double t_min, double t_max) const {
+	const traversal_ray tr(r);
+
+	traversal_count count;
+	uint32_t stack[max_depth];
+	int top = 0;
+	uint32_t current = 0;
+	for (;;) {
+		const auto& node = nodes[current];
+		++count.nodes;
+		if (node_hit(node, tr, t_min, t_max)) {
+			if (node.count > 0) {
+				for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+					++count.tests;
+					if (primitives[i]->occluded(r, t_min, t_max)) return true;
+				}
+			}
+			else {
+				if (tr.negative[node.axis]) {
+					stack[top++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[top++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+		if (top == 0) break;
+		current = stack[--top];
+	}
+	return false;
+}
+
+// Whole-packet traversal: a node is entered with the range of rays from the first to the
+// last active one that hit it, found by the first ray's own test, the packet's frustum or
+// scans from both ends, and rays outside it skip the subtree. Leaves test the rays of the
+// range that enter their box against each primitive together.
+void linear_bvh::intersect_packet(ray_packet& packet, int first, int last, const uint8_t* active) const {
+	if (first >= last) return;
+	struct entry {
+		uint32_t node;
+		int first, last;
+	};
+
+	traversal_count count;
+	entry stack[max_depth];
+	int top = 0;
+	entry current{ 0, first, last };
+	uint8_t entering[ray_packet::max_size];
+	uint16_t active_before[ray_packet::max_size + 1]; // Active rays ahead of each one, for the node counts
+	active_before[first] = 0;
+	for (int n = first; n < last; ++n)
+		active_before[n + 1] = active_before[n] + active[n];
+	for (;;) {
+		const auto& node = nodes[current.node];
+		count.nodes += active_before[current.last] - active_before[current.first]; // Per ray that reaches it, as single rays count
+		const double bounds[2][3] = {
+			{ node.bounds[0][0], node.bounds[0][1], node.bounds[0][2] },
+			{ node.bounds[1][0], node.bounds[1][1], node.bounds[1][2] },
+		};
+		auto [hit_first, hit_last] = packet.hit_range(bounds, current.first, current.last, active);
+		if (hit_first < hit_last) {
+			if (node.count > 0) {
+				packet.hit_mask(bounds, hit_first, hit_last, active, entering);
+				uint64_t entered = 0;
+				for (int n = hit_first; n < hit_last; ++n)
+					entered += entering[n];
+				count.tests += entered * node.count;
+				for (uint32_t i = node.offset; i < node.offset + node.count; ++i)
+					primitives[i]->intersect_packet(packet, hit_first, hit_last, entering);
+			}
+			else {
+				// The near child of the first ray that hit goes first
+				uint32_t near = current.node + 1, far = node.offset;
+				if (std::signbit(packet.inv_direction[node.axis][hit_first])) std::swap(near, far);
+				stack[top++] = { far, hit_first, hit_last };
+				current = { near, hit_first, hit_last };
+				continue;
+			}
+		}
+		if (top == 0) break;
+		current = stack[--top];
+	}
+}
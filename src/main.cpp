@@ -1,400 +1,617 @@
 #include <iostream>
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "common.h"
 #include "color.h"
-#include "visible_collection.h"
-#include "sphere.h"
 #include "camera.h"
 #include "random_number.h"
-#include "material.h"
-#include "moving_sphere.h"
+#include "sampler.h"
 #include "bvh.h"
-#include "aarect.h"
-#include "box.h"
-#include "constant_medium.h"
-
-visible_collection random_scene() {
-	visible_collection world;
-
-	auto checker = std::make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-	world.add(std::make_shared<sphere>(vec3(0, -1000, 0), 1000, std::make_shared<lambertian>(checker)));
-
-	for (int a = -11; a < 11; a++) {
-		for (int b = -11; b < 11; b++) {
-			auto choose_mat = random_double();
-			vec3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-			if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
-				std::shared_ptr<material> sphere_material;
-
-				if (choose_mat < 0.8) {
-					// diffuse
-					auto albedo = color::random() * color::random();
-					sphere_material = std::make_shared<lambertian>(albedo);
-					auto center2 = center + vec3(0, random_double(0, .5), 0);
-					world.add(std::make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
-				}
-				else if (choose_mat < 0.95) {
-					// metal
-					auto albedo = color::random(0.5, 1);
-					auto fuzz = random_double(0, 0.5);
-					sphere_material = std::make_shared<metal>(albedo, fuzz);
-					world.add(std::make_shared<sphere>(center, 0.2, sphere_material));
-				}
-				else {
-					// glass
-					sphere_material = std::make_shared<dielectric>(1.5);
-					world.add(std::make_shared<sphere>(center, 0.2, sphere_material));
-				}
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "scene.h"
+#include "scenes.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include "image_io.h"
+#include "checkpoint.h"
+#include "tile_server.h"
+
+struct options {
+	std::string scene = "final_scene";
+	std::optional<int> width;
+	std::optional<int> height; // Defaults to the width, square images
+	std::optional<int> samples_per_pixel;
+	int first_sample = 0;
+	std::string accumulation_path;
+	std::optional<int> max_depth;
+	std::optional<int> rr_depth;
+	double ao_radius = 0;
+	double adaptive_threshold = 0;
+	std::optional<int> adaptive_pass;
+	std::string sample_map_path;
+	std::string stats_path;
+	bool progressive = false;
+	double time_budget = 0;
+	double snapshot_interval = 0;
+	std::string checkpoint_path;
+	double checkpoint_interval = 60;
+	std::string resume_path;
+	std::string serve_address;
+	std::string worker_address;
+	bvh_layout bvh = bvh_layout::binary;
+	int packet_size = 0;
+	render_integrator integrator = render_integrator::recursive;
+	std::optional<int> wavefront_batch;
+	bool reorder_rays = false;
+	size_t threads = 0; // One per physical core
+	uint64_t seed = 0;
+	std::string output_path = "-";
+	std::optional<image_format> output_format;
+	bool sample_lights = true;
+	bool bench = false;
+	bool list_scenes = false;
+};
+
+void print_usage(const char* program) {
+	std::cerr << "Usage: " << program << " [options]\n"
+		<< "  --scene <name>        Scene to render, default final_scene (see --list-scenes)\n"
+		<< "  --width <pixels>      Image width, default 800\n"
+		<< "  --height <pixels>     Image height, default the width\n"
+		<< "  --spp <samples>       Samples per pixel, default 100\n"
+		<< "  --first-sample <index> Take each pixel's samples from this index on, to split a frame across processes\n"
+		<< "  --accumulation <file> Also write the raw sums and counts for raytracer_merge, instead of the image unless -o is a file\n"
+		<< "  --depth <bounces>     Maximum path depth, default 50\n"
+		<< "  --rr-depth <bounces>  Bounces before Russian roulette, default 3, 0 from the first bounce\n"
+		<< "  --no-light-sampling   Find lights only through BSDF sampling\n"
+		<< "  --ao <radius>         Render an ambient occlusion preview with this occlusion radius\n"
+		<< "  --adaptive <error>    Stop sampling pixels once the standard error of their displayed (gamma 2) brightness\n"
+		<< "                        is under this, or they are white within it, --spp is the cap\n"
+		<< "  --adaptive-pass <spp> Samples added to unconverged pixels per adaptive pass, default 16\n"
+		<< "  --sample-map <file>   Also write the samples taken per pixel, relative to --spp\n"
+		<< "  --stats <file>        Write ray, traversal and path length counts as JSON, - for stdout\n"
+		<< "  --progressive         Render the whole frame at 1, 2, 4... samples per pixel up to --spp\n"
+		<< "  --time-budget <s>     Stop starting new tiles after this many seconds of rendering\n"
+		<< "  --snapshot <s>        Write the image so far to the output file at most this often, between passes\n"
+		<< "  --checkpoint <file>   Save the render in progress to this file periodically and on SIGINT or SIGTERM\n"
+		<< "  --checkpoint-interval <s> Seconds between checkpoints, default 60\n"
+		<< "  --resume <file>       Continue a checkpointed render with its scene, settings and BVH layout, checkpointing to the same file\n"
+		<< "  --serve <address>     Coordinate workers rendering the frame's tiles, unix:<path> or [host]:<port>\n"
+		<< "  --worker <address>    Render tiles for the coordinator at this address, which sets the scene and settings\n"
+		<< "  --bvh <layout>        binary, wide4, wide8 or auto for the widest this CPU tests in one instruction, default binary\n"
+		<< "  --packets <size>      Trace camera rays in packets of size x size pixels, 8 or 16\n"
+		<< "  --integrator <name>   recursive, one path at a time (default), or wavefront, batches of paths stage by stage\n"
+		<< "  --batch <paths>       Paths per wavefront batch and thread, default 1024\n"
+		<< "  --reorder             Sort each wavefront batch's bounces by direction octant and origin before tracing them\n"
+		<< "  --threads <count>     Render threads, default one per physical core\n"
+		<< "  --seed <value>        Seed for scene generation and sampling, default 0\n"
+		<< "  -o, --output <file>   Output image, - for stdout (default)\n"
+		<< "  --format <format>     p3, ppm, pfm or png, default from the extension or ppm\n"
+		<< "  --bench               Render every scene with a fixed seed and print timings as JSON lines\n"
+		<< "  --list-scenes         Print the scene names\n";
+}
+
+std::optional<options> parse_options(int argc, char* argv[]) {
+	options opts;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&]() -> std::optional<std::string> {
+			if (i + 1 >= argc) {
+				std::cerr << "ERROR: " << arg << " needs a value.\n";
+				return std::nullopt;
+			}
+			return std::string(argv[++i]);
+		};
+		auto positive_real = [&]() -> std::optional<double> {
+			auto text = value();
+			if (!text) return std::nullopt;
+			try {
+				size_t used = 0;
+				auto parsed = std::stod(*text, &used);
+				if (used == text->size() && parsed > 0) return parsed;
+			}
+			catch (const std::exception&) {}
+			std::cerr << "ERROR: Invalid value " << *text << " for " << arg << ".\n";
+			return std::nullopt;
+		};
+		auto number = [&](long long min) -> std::optional<long long> {
+			auto text = value();
+			if (!text) return std::nullopt;
+			try {
+				size_t used = 0;
+				auto parsed = std::stoll(*text, &used);
+				if (used == text->size() && parsed >= min) return parsed;
+			}
+			catch (const std::exception&) {}
+			std::cerr << "ERROR: Invalid value " << *text << " for " << arg << ".\n";
+			return std::nullopt;
+		};
+
+		if (arg == "--scene") {
+			auto name = value();
+			if (!name) return std::nullopt;
+			opts.scene = *name;
+		}
+		else if (arg == "--width" || arg == "--height" || arg == "--spp" || arg == "--depth") {
+			auto parsed = number(1);
+			if (!parsed) return std::nullopt;
+			auto& target = arg == "--width" ? opts.width : arg == "--height" ? opts.height : arg == "--spp" ? opts.samples_per_pixel : opts.max_depth;
+			target = static_cast<int>(*parsed);
+		}
+		else if (arg == "--rr-depth") {
+			auto parsed = number(0);
+			if (!parsed) return std::nullopt;
+			opts.rr_depth = static_cast<int>(*parsed);
+		}
+		else if (arg == "--ao" || arg == "--adaptive" || arg == "--time-budget" || arg == "--snapshot" || arg == "--checkpoint-interval") {
+			auto parsed = positive_real();
+			if (!parsed) return std::nullopt;
+			auto& target = arg == "--ao" ? opts.ao_radius : arg == "--adaptive" ? opts.adaptive_threshold : arg == "--time-budget" ? opts.time_budget
+				: arg == "--snapshot" ? opts.snapshot_interval : opts.checkpoint_interval;
+			target = *parsed;
+		}
+		else if (arg == "--checkpoint" || arg == "--resume" || arg == "--accumulation") {
+			auto path = value();
+			if (!path) return std::nullopt;
+			(arg == "--checkpoint" ? opts.checkpoint_path : arg == "--resume" ? opts.resume_path : opts.accumulation_path) = *path;
+		}
+		else if (arg == "--serve" || arg == "--worker") {
+			auto address = value();
+			if (!address) return std::nullopt;
+			(arg == "--serve" ? opts.serve_address : opts.worker_address) = *address;
+		}
+		else if (arg == "--first-sample") {
+			auto parsed = number(0);
+			if (!parsed) return std::nullopt;
+			opts.first_sample = static_cast<int>(*parsed);
+		}
+		else if (arg == "--progressive")
+			opts.progressive = true;
+		else if (arg == "--adaptive-pass") {
+			auto parsed = number(2);
+			if (!parsed) return std::nullopt;
+			opts.adaptive_pass = static_cast<int>(*parsed);
+		}
+		else if (arg == "--sample-map" || arg == "--stats") {
+			auto path = value();
+			if (!path) return std::nullopt;
+			(arg == "--sample-map" ? opts.sample_map_path : opts.stats_path) = *path;
+		}
+		else if (arg == "--bvh") {
+			auto name = value();
+			if (!name) return std::nullopt;
+			auto layout = bvh_layout_from_name(*name);
+			if (!layout) {
+				std::cerr << "ERROR: Unknown BVH layout " << *name << ", expected binary, wide4, wide8 or auto.\n";
+				return std::nullopt;
+			}
+			opts.bvh = *layout;
+		}
+		else if (arg == "--packets") {
+			auto parsed = number(1);
+			if (!parsed) return std::nullopt;
+			if (*parsed != 8 && *parsed != 16) {
+				std::cerr << "ERROR: --packets takes 8 or 16.\n";
+				return std::nullopt;
+			}
+			opts.packet_size = static_cast<int>(*parsed);
+		}
+		else if (arg == "--integrator") {
+			auto name = value();
+			if (!name) return std::nullopt;
+			if (*name == "recursive")
+				opts.integrator = render_integrator::recursive;
+			else if (*name == "wavefront")
+				opts.integrator = render_integrator::wavefront;
+			else {
+				std::cerr << "ERROR: Unknown integrator " << *name << ", expected recursive or wavefront.\n";
+				return std::nullopt;
 			}
 		}
+		else if (arg == "--batch") {
+			auto parsed = number(1);
+			if (!parsed) return std::nullopt;
+			opts.wavefront_batch = static_cast<int>(*parsed);
+		}
+		else if (arg == "--reorder")
+			opts.reorder_rays = true;
+		else if (arg == "--threads") {
+			auto parsed = number(0);
+			if (!parsed) return std::nullopt;
+			opts.threads = static_cast<size_t>(*parsed);
+		}
+		else if (arg == "--seed") {
+			auto parsed = number(0);
+			if (!parsed) return std::nullopt;
+			opts.seed = static_cast<uint64_t>(*parsed);
+		}
+		else if (arg == "-o" || arg == "--output") {
+			auto path = value();
+			if (!path) return std::nullopt;
+			opts.output_path = *path;
+		}
+		else if (arg == "--format") {
+			auto name = value();
+			if (!name) return std::nullopt;
+			opts.output_format = image_format_from_name(*name);
+			if (!opts.output_format) {
+				std::cerr << "ERROR: Unknown image format " << *name << ", expected p3, ppm, pfm or png.\n";
+				return std::nullopt;
+			}
+		}
+		else if (arg == "--no-light-sampling")
+			opts.sample_lights = false;
+		else if (arg == "--bench")
+			opts.bench = true;
+		else if (arg == "--list-scenes")
+			opts.list_scenes = true;
+		else {
+			std::cerr << "ERROR: Unknown option " << arg << ".\n";
+			return std::nullopt;
+		}
 	}
+	if (opts.packet_size > 0 && opts.integrator == render_integrator::wavefront) {
+		std::cerr << "ERROR: --packets traces camera rays for the recursive integrator only.\n";
+		return std::nullopt;
+	}
+	if ((opts.wavefront_batch || opts.reorder_rays) && opts.integrator != render_integrator::wavefront) {
+		std::cerr << "ERROR: --batch and --reorder apply to --integrator wavefront.\n";
+		return std::nullopt;
+	}
+	return opts;
+}
 
-	auto material1 = std::make_shared<dielectric>(1.5);
-	world.add(std::make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
-
-	auto material2 = std::make_shared<lambertian>(color(0.4, 0.2, 0.1));
-	world.add(std::make_shared<sphere>(vec3(-4, 1, 0), 1.0, material2));
+// Whether the command line chooses how to trace, which --resume and --worker take from elsewhere
+bool sets_tracing(const options& opts) {
+	return opts.bvh != bvh_layout::binary || opts.packet_size > 0 || opts.integrator != render_integrator::recursive || opts.wavefront_batch || opts.reorder_rays;
+}
 
-	auto material3 = std::make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-	world.add(std::make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+struct run_timings {
+	double scene_seconds = 0;
+	double bvh_seconds = 0;
+	render_stats render;
+	double output_seconds = 0;
+};
 
-	return world;
+double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-visible_collection two_spheres() {
-	visible_collection objects;
-	auto checker = std::make_shared<lambertian>(
-		std::make_shared<checker_texture>(
-			color(0.2, 0.3, 0.1),
-			color(0.9, 0.9, 0.9)
-	));
-	objects.add(std::make_shared<sphere>(vec3{ 0, -10, 0 }, 10, checker));
-	objects.add(std::make_shared<sphere>(vec3{ 0, 10, 0 }, 10, checker));
-	return objects;
+framebuffer_view view_of(const accumulation_buffer& framebuffer, int samples_per_pixel) {
+	return { framebuffer.sums.data(), framebuffer.width, framebuffer.height, samples_per_pixel, framebuffer.counts.data() };
 }
 
-visible_collection two_perlin_spheres() {
-	visible_collection objects;
-	auto pertext = std::make_shared<lambertian>(std::make_shared<noise_texture>(4));
-	objects.add(std::make_shared<sphere>(vec3{ 0, -1000, 0 }, 1000, pertext));
-	objects.add(std::make_shared<sphere>(vec3{ 0, 2, 0 }, 2, pertext));
-	return objects;
+// Writes through a temporary file so a reader never sees a half written snapshot
+bool write_snapshot(const std::string& path, image_format format, const framebuffer_view& image, thread_pool* pool) {
+	return replace_file(path, encode_image(format, image, pool));
 }
 
-visible_collection earth() {
-	auto earth_texture = std::make_shared<image_texture>("Blue_Marble_2002.png");
-	auto earth_surface = std::make_shared<lambertian>(earth_texture);
-	auto globe = std::make_shared<sphere>(vec3(0, 0, 0), 2, earth_surface);
-	return visible_collection(globe);
-}
+// Set by the first SIGINT or SIGTERM while checkpointing, a second one terminates as usual
+std::atomic_bool stop_requested{ false };
+static_assert(std::atomic_bool::is_always_lock_free);
 
-visible_collection simple_light() {
-	visible_collection objects;
-	auto pertext = std::make_shared<lambertian>(std::make_shared<noise_texture>(4));
-	objects.add(std::make_shared<sphere>(vec3{ 0, -1000, 0 }, 1000, pertext));
-	objects.add(std::make_shared<sphere>(vec3{ 0, 2, 0 }, 2, pertext));
-	auto difflight = std::make_shared<diffuse_light>(color(4, 4, 4));
-	objects.add(std::make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
-	auto nolight = std::make_shared<diffuse_light>(color(0, 0, 0));
-	objects.add(std::make_shared<sphere>(vec3{ 0, 0, 0 }, -10000, nolight));
-	return objects;
+extern "C" void request_stop(int signal) {
+	stop_requested = true;
+	std::signal(signal, SIG_DFL);
 }
 
-visible_collection cornell_box() {
-	visible_collection objects;
-	auto red = std::make_shared<lambertian>(color(.65, .05, .05));
-	auto white = std::make_shared<lambertian>(color(.73, .73, .73));
-	auto green = std::make_shared<lambertian>(color(.12, .45, .15));
-	auto light = std::make_shared<diffuse_light>(color(15, 15, 15));
-	auto background = std::make_shared<diffuse_light>(color(0, 0, 0));
-	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-
-	objects.add(std::make_shared<xz_rect>(213, 343, 227, 332, 554, light));
-	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-
-	objects.add(std::make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-	objects.add(std::make_shared<sphere>(vec3{ 277, 277, 277 }, -2216, background));
-
-	std::shared_ptr<visible> box1 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 330, 165 }, white);
-	box1 = std::make_shared<rotate_y>(box1, 15);
-	box1 = std::make_shared<translate>(box1, vec3{ 265, 0, 295 });
-	std::shared_ptr<visible> box2 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 165, 165 }, white);
-	box2 = std::make_shared<rotate_y>(box2, -18);
-	box2 = std::make_shared<translate>(box2, vec3{ 130, 0, 65 });
-
-	objects.add(box1);
-	objects.add(box2);
-	return objects;
-}
+// Renders a prepared scene, with its lights for next-event estimation
+using frame_renderer = std::function<render_stats(const camera&, const visible&, const visible_collection&)>;
 
-visible_collection cornell_smoke() {
-	visible_collection objects;
-	auto red = std::make_shared<lambertian>(color(.65, .05, .05));
-	auto white = std::make_shared<lambertian>(color(.73, .73, .73));
-	auto green = std::make_shared<lambertian>(color(.12, .45, .15));
-	auto light = std::make_shared<diffuse_light>(color(7, 7, 7));
-	auto background = std::make_shared<diffuse_light>(color(0, 0, 0));
-	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-
-	objects.add(std::make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-
-	objects.add(std::make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-	objects.add(std::make_shared<sphere>(vec3{ 277, 277, 277 }, -2216, background));
-
-	std::shared_ptr<visible> box1 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 330, 165 }, white);
-	box1 = std::make_shared<rotate_y>(box1, 15);
-	box1 = std::make_shared<translate>(box1, vec3{ 265, 0, 295 });
-	std::shared_ptr<visible> box2 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 165, 165 }, white);
-	box2 = std::make_shared<rotate_y>(box2, -18);
-	box2 = std::make_shared<translate>(box2, vec3{ 130, 0, 65 });
-
-	objects.add(std::make_shared<constant_medium>(box1, 0.01, color{ 0, 0, 0 }));
-	objects.add(std::make_shared<constant_medium>(box2, 0.01, color{ 1, 1, 1 }));
-	return objects;
+template <int W>
+std::unique_ptr<visible> make_wide_bvh(const linear_bvh& binary, bool verbose) {
+	auto wide = std::make_unique<wide_bvh<W>>(binary);
+	if (verbose)
+		std::cerr << "Wide BVH: " << wide->node_count() << " nodes of " << W << " (" << wide->node_count() * sizeof(wide_bvh_node<W>) << " bytes), "
+			<< wide->kernel_name() << " node test\n";
+	return wide;
 }
 
-visible_collection final_scene() {
-	visible_collection boxes1;
-	auto ground = std::make_shared<lambertian>(color{ 0.48, 0.83, 0.53 });
-
-	const int boxes_per_side = 20;
-	for (int i = 0; i < boxes_per_side; ++i)
-		for (int j = 0; j < boxes_per_side; ++j) {
-			auto w = 100.0;
-			auto x0 = -1000.0 + i * w;
-			auto z0 = -1000.0 + j * w;
-			auto y0 = 0.0;
-			auto x1 = x0 + w;
-			auto z1 = z0 + w;
-			auto y1 = random_double(1, 101);
-			boxes1.add(std::make_shared<box>(vec3{ x0, y0, z0 }, vec3{ x1, y1, z1 }, ground));
-		}
+// Builds the preset's scene and BVH in the settings' layout and renders it with `render_frame`
+run_timings render_preset(const scene_preset& preset, const render_settings& settings, thread_pool& pool, bool verbose, const frame_renderer& render_frame) {
+	run_timings timings;
+
+	// Scene generation draws from its own stream so --seed reproduces it
+	auto scene_start = std::chrono::steady_clock::now();
+	sampler scene_rng(settings.seed);
+	scene world_scene;
+	{
+		sampler_scope bind(scene_rng);
+		world_scene = preset.build();
+	}
+	world_scene.find_lights();
+	timings.scene_seconds = seconds_since(scene_start);
+
+	auto bvh_start = std::chrono::steady_clock::now();
+	bvh_build_options bvh_options;
+	bvh_options.pool = &pool;
+	bvh_build_stats bvh_stats;
+	bvh_node tree(world_scene.objects, 0.0, 1.0, bvh_options, &bvh_stats);
+	linear_bvh world(tree);
+	if (verbose) {
+		std::cerr << "BVH built in " << bvh_stats.build_seconds * 1000 << "ms, peak about " << bvh_stats.peak_bytes / 1024 << " KiB, "
+			<< bvh_stats.nodes << " nodes, " << bvh_stats.leaves << " leaves, SAH cost " << tree.sah_cost(bvh_options) << '\n';
+		std::cerr << "Linear BVH: " << world.node_count() << " nodes (" << world.node_count() * sizeof(linear_bvh_node) << " bytes), "
+			<< world.primitive_count() << " primitives\n";
+	}
+	std::unique_ptr<visible> wide;
+	auto layout = settings.bvh == bvh_layout::automatic ? best_bvh_layout() : settings.bvh;
+	if (layout == bvh_layout::wide4) wide = make_wide_bvh<4>(world, verbose);
+	else if (layout == bvh_layout::wide8) wide = make_wide_bvh<8>(world, verbose);
+	timings.bvh_seconds = seconds_since(bvh_start);
+	if (verbose)
+		std::cerr << "Sampling " << world_scene.lights.size() << " lights" << (settings.sample_lights ? "" : " (disabled)") << '\n';
 
-	visible_collection objects;
-	objects.add(std::make_shared<bvh_node>(boxes1, 0, 1));
-
-	auto light = std::make_shared<diffuse_light>(color{ 7, 7, 7 });
-	objects.add(std::make_shared<xz_rect>(123, 423, 147, 412, 554, light));
-
-	auto center1 = vec3(400, 400, 200);
-	auto center2 = center1 + vec3(30, 0, 0);
-	auto moving_sphere_material = std::make_shared<lambertian>(color{ 0.7, 0.3, 0.1 });
-	objects.add(std::make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
-
-	objects.add(std::make_shared<sphere>(vec3{ 260, 150, 45 }, 50, std::make_shared<dielectric>(1.5)));
-	objects.add(std::make_shared<sphere>(vec3{ 0, 150, 145 }, 50, std::make_shared<metal>(color{ 0.8, 0.8, 0.9 }, 1.0)));
-
-	auto boundary = std::make_shared<sphere>(vec3{ 360, 150, 145 }, 70, std::make_shared<dielectric>(1.5));
-	objects.add(boundary);
-	objects.add(std::make_shared<constant_medium>(boundary, 0.2, color{ 0.2, 0.4, 0.9 }));
-
-	objects.add(std::make_shared<constant_medium>(
-		std::make_shared<sphere>(vec3{ 0, 0, 0 }, 5000, nullptr), 0.0001, color{ 1, 1, 1 }));
-
-	auto emat = std::make_shared<lambertian>(std::make_shared<image_texture>("Blue_Marble_2002.png"));
-	objects.add(std::make_shared<sphere>(vec3{ 400, 200, 400 }, 100, emat));
-	
-	auto permat = std::make_shared<lambertian>(std::make_shared<noise_texture>(0.1));
-	objects.add(std::make_shared<sphere>(vec3{ 220, 280, 300 }, 80, permat));
-
-	visible_collection boxes2;
-	auto white = std::make_shared<lambertian>(color{ .73, .73, .73 });
-	int ns = 1000;
-	for (int j = 0; j < ns; j++)
-		boxes2.add(std::make_shared<sphere>(vec3::random(0, 165), 10, white));
-	objects.add(std::make_shared<translate>(
-		std::make_shared<rotate_y>(
-			std::make_shared<bvh_node>(boxes2, 0.0, 1.0),
-			15
-		),
-		vec3{ -100, 270, 395 }
-	));
-
-	return objects;
+	// Camera
+	vec3 vup(0, 1, 0);
+	auto dist_to_focus = 10.0;
+	auto aspect_ratio = static_cast<double>(settings.width) / settings.height;
+	camera cam(preset.lookfrom, preset.lookat, vup, preset.vfov, aspect_ratio, preset.aperture, dist_to_focus, 0.0, 1.0);
+
+	pool.reset_stats();
+	if (verbose) std::cerr << "Rendering " << preset.name << " on " << pool.size() << " workers.\n" << std::flush;
+	timings.render = render_frame(cam, wide ? *wide : static_cast<const visible&>(world), world_scene.lights);
+
+	if (verbose) {
+		double busy = 0;
+		auto stats = pool.stats();
+		for (size_t w = 0; w < stats.size(); ++w) {
+			std::cerr << "Worker " << w << ": busy " << stats[w].busy_seconds << "s, idle " << stats[w].idle_seconds
+				<< "s, " << stats[w].tasks_run << " tiles (" << stats[w].tasks_stolen << " stolen)\n";
+			busy += stats[w].busy_seconds;
+		}
+		std::cerr << "Render: " << timings.render.seconds << "s wall, " << busy << "s busy, "
+			<< 100.0 * busy / (timings.render.seconds * pool.size()) << "% utilization, "
+			<< timings.render.rays / timings.render.seconds / 1e6 << " Mrays/s, "
+			<< double(timings.render.samples) / (size_t(settings.width) * settings.height) << " samples per pixel on average\n";
+		const auto& counters = timings.render.counters;
+		if (counters.rays() > 0)
+			std::cerr << "Rays: " << counters.camera_rays << " camera, " << counters.secondary_rays << " secondary, " << counters.shadow_rays << " shadow; "
+				<< double(counters.nodes_visited) / counters.rays() << " nodes and " << double(counters.primitive_tests) / counters.rays() << " primitive tests per ray\n";
+		if (timings.render.out_of_time)
+			std::cerr << "Time budget reached after " << timings.render.passes << " passes.\n";
+		if (timings.render.interrupted)
+			std::cerr << "Interrupted in pass " << timings.render.passes << ".\n";
+	}
+	return timings;
 }
 
-color ray_color(const ray& r, const visible& world, int depth) {
-	if (depth <= 0) return color(0, 0, 0);
+// Renders every preset with the same settings, one JSON object per line on stdout
+int run_bench(const options& opts, render_settings settings, thread_pool& pool) {
+	// Small enough that the whole set finishes in reasonable time unless overridden
+	settings.width = opts.width.value_or(200);
+	settings.height = opts.height.value_or(settings.width);
+	settings.samples_per_pixel = opts.samples_per_pixel.value_or(16);
+	settings.progress = false;
+	auto format = opts.output_format.value_or(image_format::png);
+
+	render_state state;
+	for (const auto& preset : scene_presets()) {
+		std::cerr << "Benchmarking " << preset.name << "...\n";
+		state.reset(settings.width, settings.height);
+		auto timings = render_preset(preset, settings, pool, false, [&](const camera& cam, const visible& world, const visible_collection& lights) {
+			return render(cam, world, lights, settings, pool, state);
+		});
+
+		auto output_start = std::chrono::steady_clock::now();
+		auto encoded = encode_image(format, view_of(state.buffer, settings.samples_per_pixel), &pool);
+		timings.output_seconds = seconds_since(output_start);
+
+		std::printf(
+			"{\"scene\":\"%s\",\"width\":%d,\"height\":%d,\"spp\":%d,\"depth\":%d,\"rr_depth\":%d,\"light_sampling\":%s,\"threads\":%zu,\"seed\":%llu,"
+			"\"scene_build_s\":%.6f,\"bvh_build_s\":%.6f,\"render_s\":%.6f,\"output_s\":%.6f,\"output_bytes\":%zu,"
+			"\"samples\":%llu,\"rays\":%llu,\"mrays_per_s\":%.4f,\"counters\":%s}\n",
+			preset.name.c_str(), settings.width, settings.height, settings.samples_per_pixel, settings.max_depth, settings.rr_depth, settings.sample_lights ? "true" : "false", pool.size(),
+			static_cast<unsigned long long>(settings.seed), timings.scene_seconds, timings.bvh_seconds, timings.render.seconds,
+			timings.output_seconds, encoded.size(), static_cast<unsigned long long>(timings.render.samples), static_cast<unsigned long long>(timings.render.rays),
+			timings.render.rays / timings.render.seconds / 1e6, timings.render.counters.json().c_str());
+		std::fflush(stdout);
+	}
+	return 0;
+}
 
-	auto rec = world.hit_check(r, 0.001, infinity);
-	if (rec) {
-		auto scatter = rec->mat_ptr->scatter_check(r, rec.value());
-		color emitted = rec->mat_ptr->emitted(rec->u, rec->v, rec->point);
-		if (scatter) emitted += scatter->attenuation * ray_color(scatter->bounce, world, depth - 1);
-		return emitted;
+#ifndef _WIN32
+// Renders tiles for a coordinator until it has the whole frame
+int run_worker(const options& opts, thread_pool& pool) {
+	tile_worker worker;
+	if (!worker.connect(opts.worker_address)) return 1;
+	// Traced as the coordinator says, so media scenes come out as from a single process
+	const auto& settings = worker.settings();
+	auto preset = find_scene_preset(worker.scene());
+	if (!preset) {
+		std::cerr << "ERROR: Unknown scene " << worker.scene() << " from the coordinator.\n";
+		return 1;
 	}
 
-	/*vec3 unit_direction = unit_vector(r.direction());
-	auto t = 0.5 * (unit_direction.y() + 1.0);
-	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);*/
-	return color(0, 0, 0);
+	auto timings = render_preset(*preset, settings, pool, true, [&](const camera& cam, const visible& world, const visible_collection& lights) {
+		const visible_collection no_lights;
+		const auto& sampled_lights = settings.sample_lights ? lights : no_lights;
+		return worker.run(pool, [&](const tile& t, accumulation_buffer& buffer) {
+			return render_tile(t, buffer, settings.samples_per_pixel, nullptr, settings, cam, world, sampled_lights);
+		});
+	});
+	return timings.render.interrupted ? 1 : 0;
 }
 
-struct image {
-	uint64_t width, height;
-};
-
-// [Hacky multithreading support]
-#include <thread>
-#include <atomic>
-#include <sstream>
-std::atomic_int scanlines{ 0 };
-void t_func(
-	int start, int end, color* data,
-	int height, int width, int samples_per_pixel,
-	const camera& cam, const bvh_node& world, int max_depth
-) {
-	for (int j = start; j < end; ++j) {
-		for (int i = 0; i < width; ++i) {
-			int k = height - 1 - j; // Top to bottom
-			color pixel(0, 0, 0);
-			for (int s = 0; s < samples_per_pixel; ++s) {
-				auto u = (i + random_double()) / (width - 1);
-				auto v = (k + random_double()) / (height - 1);
-				ray r = cam.get_ray(u, v);
-				pixel += ray_color(r, world, max_depth);
-			}
-			data[j * width + i] = pixel;
-		}
-		int print_val = ++scanlines;
-		std::stringstream msg;
-		msg << "\rScanlines remaining: " << (height - print_val) << ' ';
-		std::cerr << msg.str();
-	}
+void print_worker_reports(const std::vector<worker_report>& workers) {
+	for (const auto& w : workers)
+		std::cerr << "Worker " << (w.name.empty() ? "(unnamed)" : w.name) << ": " << w.tiles << " tiles, " << w.samples << " samples in " << w.seconds << "s, "
+			<< w.rays / std::max(w.seconds, 1e-9) / 1e6 << " Mrays/s, " << w.samples / std::max(w.seconds, 1e-9) / 1e3 << " ksamples/s"
+			<< (w.lost ? ", lost with tiles unfinished" : "") << '\n';
 }
-// [/Hacky multithreading support]
+#endif
 
-int main(int argc, char* argv) {
+int main(int argc, char* argv[]) {
 	assert((int)(256 * clamp(1, 0.0, almost_one)) == 255);
 
-	// Render target
-	constexpr double aspect_ratio = 1.0;// 16.0 / 9.0;
-	constexpr int img_width = 800;
-	const image img{ .width = img_width, .height = static_cast<int>(img_width / aspect_ratio) };
-	constexpr int samples_per_pixel = 100;// 10'000;
-	constexpr int max_depth = 50;
+	auto parsed = parse_options(argc, argv);
+	if (!parsed) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	const auto& opts = *parsed;
 
-	// Camera
-	vec3 lookfrom;
-	vec3 lookat;
-	auto vfov = 40.0;
-	auto aperture = 0.0;
-
-	// Scene
-	visible_collection scene;
-	switch (0) {
-	case 1:
-		scene = random_scene();
-		lookfrom = vec3(13, 2, 3);
-		lookat = vec3(0, 0, 0);
-		vfov = 20.0;
-		aperture = 0.1;
-		break;
-	case 2:
-		scene = two_spheres();
-		lookfrom = vec3(13, 2, 3);
-		lookat = vec3(0, 0, 0);
-		vfov = 20.0;
-		break;
-	case 3:
-		scene = two_perlin_spheres();
-		lookfrom = vec3(13, 2, 3);
-		lookat = vec3(0, 0, 0);
-		vfov = 20.0;
-		break;
-	case 4:
-		scene = earth();
-		lookfrom = vec3(13, 2, 3);
-		lookat = vec3(0, 0, 0);
-		vfov = 20.0;
-		break;
-	case 5:
-		scene = simple_light();
-		lookfrom = vec3(26, 3, 6);
-		lookat = vec3(0, 2, 0);
-		vfov = 20.0;
-		break;
-	case 6:
-		scene = cornell_box();
-		lookfrom = vec3(278, 278, -800);
-		lookat = vec3(278, 278, 0);
-		vfov = 40.0;
-		break;
-	case 7:
-		scene = cornell_smoke();
-		lookfrom = vec3(278, 278, -800);
-		lookat = vec3(278, 278, 0);
-		vfov = 40.0;
-		break;
-	default:
-	case 8:
-		scene = final_scene();
-		lookfrom = vec3(478, 278, -600);
-		lookat = vec3(278, 278, 0);
-		vfov = 40.0;
-		break;
+	if (opts.list_scenes) {
+		for (const auto& preset : scene_presets())
+			std::cout << preset.name << '\n';
+		return 0;
 	}
-	bvh_node world(scene, 0.0, 1.0);
 
-	// Camera
-	vec3 vup(0, 1, 0);
-	auto dist_to_focus = 10.0;
-	camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-
-	// [Hacky multithreading support]
-#if 0
-	std::cout << "P3\n" << img.width << ' ' << img.height << "\n255\n";
-	for (int j = img.height - 1; j >= 0; --j) {
-		std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-		for (int i = 0; i < img.width; ++i) {
-			color pixel(0, 0, 0);
-			for (int s = 0; s < samples_per_pixel; ++s) {
-				auto u = (i + random_double()) / (img.width - 1);
-				auto v = (j + random_double()) / (img.height - 1);
-				ray r = cam.get_ray(u, v);
-				pixel += ray_color(r, world, max_depth);
-			}
-			write_color(std::cout, pixel, samples_per_pixel);
-		}
+	render_settings settings;
+	settings.width = opts.width.value_or(800);
+	settings.height = opts.height.value_or(settings.width);
+	settings.samples_per_pixel = opts.samples_per_pixel.value_or(100);
+	settings.first_sample = opts.first_sample;
+	settings.max_depth = opts.max_depth.value_or(50);
+	settings.rr_depth = opts.rr_depth.value_or(3);
+	settings.sample_lights = opts.sample_lights;
+	settings.ao_radius = opts.ao_radius;
+	settings.adaptive_threshold = opts.adaptive_threshold;
+	settings.adaptive_pass = opts.adaptive_pass.value_or(16);
+	settings.progressive = opts.progressive;
+	settings.bvh = opts.bvh == bvh_layout::automatic ? best_bvh_layout() : opts.bvh;
+	settings.packet_size = opts.packet_size;
+	settings.integrator = opts.integrator;
+	settings.wavefront_batch = opts.wavefront_batch.value_or(settings.wavefront_batch);
+	settings.reorder_rays = opts.reorder_rays;
+	settings.time_budget = opts.time_budget;
+	settings.seed = opts.seed;
+
+	thread_pool pool(opts.threads > 0 ? opts.threads : physical_core_count());
+	if (opts.bench) return run_bench(opts, settings, pool);
+#ifdef _WIN32
+	if (!opts.serve_address.empty() || !opts.worker_address.empty()) {
+		std::cerr << "ERROR: --serve and --worker are not supported on Windows.\n";
+		return 1;
 	}
-	std::cerr << "\nDone.\n";
 #else
-	std::vector<color> framebuffer;
-	framebuffer.resize(img.width * img.height);
-	std::vector<std::thread> threads;
-	int cores = std::thread::hardware_concurrency();
-	std::cerr << "Found " << cores << " cores.\n" << std::flush;
-	const int num_threads = cores * 2;
-	int lines_per_thread = img.height / num_threads;
-
-	for (int i = 0; i < num_threads - 1; ++i)
-		threads.emplace_back(t_func,
-			i * lines_per_thread, (i+1) * lines_per_thread, framebuffer.data(),
-			img.height, img.width, samples_per_pixel,
-			cam, world, max_depth
-			);
-	threads.emplace_back(t_func,
-		(num_threads - 1) * lines_per_thread, img.height, framebuffer.data(),
-		img.height, img.width, samples_per_pixel,
-		cam, world, max_depth
-	);
-
-	for (std::thread& t : threads)
-		t.join();
-
-	std::cout << "P3\n" << img.width << ' ' << img.height << "\n255\n";
-	std::cerr << "\nWriting image...\n";
-	for(const auto& pixel : framebuffer)
-		write_color(std::cout, pixel, samples_per_pixel);
-	std::cerr << "\nDone.\n";
+	if (!opts.worker_address.empty()) {
+		if (sets_tracing(opts)) {
+			std::cerr << "ERROR: --worker traces as the coordinator says, without --bvh, --packets, --integrator, --batch or --reorder.\n";
+			return 1;
+		}
+		return run_worker(opts, pool);
+	}
+	if (!opts.serve_address.empty() && (settings.adaptive_threshold > 0 || settings.progressive || settings.time_budget > 0 || opts.snapshot_interval > 0
+		|| !opts.checkpoint_path.empty() || !opts.resume_path.empty())) {
+		std::cerr << "ERROR: --serve renders every tile in full, without --adaptive, --progressive, --time-budget, --snapshot, --checkpoint or --resume.\n";
+		return 1;
+	}
+#endif
+
+	// A resumed render takes everything that shapes the image from its checkpoint
+	std::string scene_name = opts.scene;
+	render_state state;
+	if (!opts.resume_path.empty()) {
+		if (sets_tracing(opts)) {
+			std::cerr << "ERROR: --resume traces as the checkpoint says, without --bvh, --packets, --integrator, --batch or --reorder.\n";
+			return 1;
+		}
+		auto saved = load_checkpoint(opts.resume_path);
+		if (!saved) return 1;
+		scene_name = saved->scene;
+		saved->settings.time_budget = settings.time_budget;
+		settings = saved->settings;
+		state = std::move(saved->state);
+		std::cerr << "Resuming " << scene_name << " in pass " << state.pass + 1 << ", " << state.buffer.total_samples() << " samples taken.\n";
+	}
+	else
+		state.reset(settings.width, settings.height);
+	auto checkpoint_path = opts.checkpoint_path.empty() ? opts.resume_path : opts.checkpoint_path;
+
+	auto preset = find_scene_preset(scene_name);
+	if (!preset) {
+		std::cerr << "ERROR: Unknown scene " << scene_name << ", see --list-scenes.\n";
+		return 1;
+	}
+	auto output_format = opts.output_format ? *opts.output_format : image_format_from_path(opts.output_path).value_or(image_format::ppm);
+	if (opts.snapshot_interval > 0 && opts.output_path == "-") {
+		std::cerr << "ERROR: --snapshot needs an output file.\n";
+		return 1;
+	}
+
+	// Snapshots go out between passes once the interval has passed since the last one
+	render_hooks hooks;
+	auto last_snapshot = std::chrono::steady_clock::now();
+	if (opts.snapshot_interval > 0)
+		hooks.on_pass = [&](const accumulation_buffer& partial, const render_stats& stats) {
+			if (seconds_since(last_snapshot) < opts.snapshot_interval) return;
+			if (write_snapshot(opts.output_path, output_format, view_of(partial, settings.samples_per_pixel), &pool))
+				std::cerr << "\rSnapshot after " << stats.passes << " passes, " << stats.seconds << "s.\n";
+			last_snapshot = std::chrono::steady_clock::now();
+		};
+
+	if (!checkpoint_path.empty()) {
+		hooks.on_checkpoint = [&](const render_state& saved) {
+			if (save_checkpoint(checkpoint_path, scene_name, settings, saved))
+				std::cerr << "\rCheckpoint saved in pass " << saved.pass + 1 << ".\n";
+		};
+		hooks.checkpoint_interval = opts.checkpoint_interval;
+		hooks.stop = &stop_requested;
+		std::signal(SIGINT, request_stop);
+		std::signal(SIGTERM, request_stop);
+	}
+
+	render_stats stats;
+	if (opts.serve_address.empty())
+		stats = render_preset(*preset, settings, pool, true, [&](const camera& cam, const visible& world, const visible_collection& lights) {
+			return render(cam, world, lights, settings, pool, state, hooks);
+		}).render;
+#ifndef _WIN32
+	else {
+		std::cerr << "Serving the tiles of " << scene_name << " on " << opts.serve_address << ".\n";
+		std::vector<worker_report> workers;
+		auto served = serve_tiles(opts.serve_address, scene_name, settings, state.buffer, workers);
+		if (!served) return 1;
+		stats = *served;
+		print_worker_reports(workers);
+		std::cerr << "Render: " << stats.seconds << "s wall, " << stats.rays / stats.seconds / 1e6 << " Mrays/s over " << workers.size() << " workers\n";
+	}
 #endif
-	// [/Hacky multithreading support]
+	std::signal(SIGINT, SIG_DFL);
+	std::signal(SIGTERM, SIG_DFL);
+
+	// A frame cut short stays resumable, one that finished no longer needs its checkpoint
+	if (!checkpoint_path.empty()) {
+		if (stats.interrupted || stats.out_of_time) {
+			if (!save_checkpoint(checkpoint_path, scene_name, settings, state)) return 1;
+			std::cerr << "Saved the render to " << checkpoint_path << ", continue it with --resume " << checkpoint_path << ".\n";
+		}
+		else {
+			std::error_code error;
+			std::filesystem::remove(checkpoint_path, error);
+		}
+	}
+	if (!opts.stats_path.empty() && !write_file(opts.stats_path, stats.counters.json() + '\n')) return 1;
+	if (stats.interrupted) return 1;
+	if (!opts.accumulation_path.empty()) {
+		if (!save_checkpoint(opts.accumulation_path, scene_name, settings, state)) return 1;
+		if (opts.output_path == "-") return 0;
+	}
+
+	std::cerr << "Writing image...\n";
+	auto write_start = std::chrono::steady_clock::now();
+	auto output = view_of(state.buffer, settings.samples_per_pixel);
+	if (!(opts.snapshot_interval > 0 ? write_snapshot(opts.output_path, output_format, output, &pool) : write_image(opts.output_path, output_format, output, &pool))) return 1;
+	if (!opts.sample_map_path.empty()) {
+		// Samples taken over the cap, written like any image so 8-bit formats apply the usual gamma
+		std::vector<color> sample_map;
+		for (auto count : state.buffer.counts)
+			sample_map.push_back(color(count, count, count));
+		framebuffer_view map{ sample_map.data(), settings.width, settings.height, settings.samples_per_pixel };
+		if (!write_image(opts.sample_map_path, image_format_from_path(opts.sample_map_path).value_or(image_format::ppm), map, &pool)) return 1;
+	}
+	std::cerr << "Done in " << seconds_since(write_start) << "s.\n";
 	return 0;
-}
\ No newline at end of file
+}
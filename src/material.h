@@ -15,8 +15,15 @@ struct scatter {
 
 class material {
 public:
-	virtual std::optional<scatter> scatter_check(const ray& r, const hit& rec) const = 0;
+	virtual ~material() = default;
+
+	virtual std::optional<scatter> scatter_check(const ray& r, const hit& rec, sampler& rng) const = 0;
 	virtual color emitted(double u, double v, const vec3& p) const { return color(0, 0, 0); }
+	virtual bool is_emissive() const { return false; }
+
+	// Solid angle density of scatter_check choosing `direction`, so that attenuation * pdf is the
+	// scattered radiance per unit incoming. 0 for (near) specular materials, which are not light sampled.
+	virtual double scattering_pdf(const ray& r, const hit& rec, const vec3& direction) const { return 0; }
 };
 
 class lambertian : public material {
@@ -24,10 +31,10 @@ public:
 	lambertian(const color& albedo) : a(std::make_shared<solid_color>(albedo)) {}
 	lambertian(std::shared_ptr<texture> albedo) : a(albedo) {}
 
-	std::optional<scatter> scatter_check(const ray& r, const hit& rec) const override {
-		//auto scatter_direction = rec.normal + random_in_unit_sphere();
-		auto scatter_direction = rec.normal + random_unit_vector();
-		//auto scatter_direction = random_in_hemisphere(rec.normal);
+	std::optional<scatter> scatter_check(const ray& r, const hit& rec, sampler& rng) const override {
+		//auto scatter_direction = rec.normal + random_in_unit_sphere(rng);
+		auto scatter_direction = rec.normal + random_unit_vector(rng);
+		//auto scatter_direction = random_in_hemisphere(rec.normal, rng);
 		if (scatter_direction.near_zero()) scatter_direction = rec.normal; // Correct degenerate directions
 		scatter s{};
 		s.bounce = ray(rec.point, scatter_direction, r.time());
@@ -35,19 +42,25 @@ public:
 		return s;
 	};
 
+	// Cosine weighted, matching scatter_check
+	double scattering_pdf(const ray& r, const hit& rec, const vec3& direction) const override {
+		auto cosine = dot(rec.normal, unit_vector(direction));
+		return cosine < 0 ? 0 : cosine / pi;
+	}
+
 private:
 	std::shared_ptr<texture> a;
 };
 
 class metal : public material {
 public:
-	metal(const color& albedo, double fuzz) : metal(std::make_shared<solid_color>(albedo), f) {}
+	metal(const color& albedo, double fuzz) : metal(std::make_shared<solid_color>(albedo), fuzz) {}
 	metal(std::shared_ptr<texture> albedo, double fuzz) : a(albedo), f(fuzz < 1 ? fuzz : 1) {}
 
-	std::optional<scatter> scatter_check(const ray& r, const hit& rec) const override {
+	std::optional<scatter> scatter_check(const ray& r, const hit& rec, sampler& rng) const override {
 		vec3 reflected = reflect(unit_vector(r.direction()), rec.normal);
 		scatter s{};
-		s.bounce = ray(rec.point, reflected + f * random_in_unit_sphere(), r.time());
+		s.bounce = ray(rec.point, reflected + f * random_in_unit_sphere(rng), r.time());
 		s.attenuation = this->a->value(rec.u, rec.v, rec.point);
 		if (dot(s.bounce.direction(), rec.normal) > 0) return s;
 		return std::nullopt;
@@ -61,7 +74,7 @@ class dielectric : public material {
 public:
 	dielectric(double refractive_index) : i(refractive_index) {}
 
-	std::optional<scatter> scatter_check(const ray& r, const hit& rec) const override {
+	std::optional<scatter> scatter_check(const ray& r, const hit& rec, sampler& rng) const override {
 		double refraction_ratio = rec.front_face ? (1.0 / i) : i;
 
 		vec3 unit_direction = unit_vector(r.direction());
@@ -70,7 +83,7 @@ public:
 
 		bool cannot_refract = refraction_ratio * sin_theta > 1.0;
 		vec3 direction;
-		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
+		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > rng.next_double()) {
 			direction = reflect(unit_direction, rec.normal);
 		}
 		else {
@@ -95,10 +108,10 @@ private:
 
 class diffuse_light : public material {
 public:
-	diffuse_light(const color& emit) : e(std::make_shared<solid_color>(emit)) {}
-	diffuse_light(std::shared_ptr<texture> emit) : e(emit) {}
+	diffuse_light(const color& emit) : e(std::make_shared<solid_color>(emit)), black(emit.max_component() <= 0) {}
+	diffuse_light(std::shared_ptr<texture> emit) : e(emit), black(false) {}
 
-	std::optional<scatter> scatter_check(const ray& r, const hit& rec) const override {
+	std::optional<scatter> scatter_check(const ray& r, const hit& rec, sampler& rng) const override {
 		return std::nullopt;
 	};
 
@@ -106,8 +119,12 @@ public:
 		return e->value(u, v, p);
 	}
 
+	// Black "lights" only close off scenes and are not worth sampling
+	bool is_emissive() const override { return !black; }
+
 private:
 	std::shared_ptr<texture> e;
+	bool black;
 };
 
 class isotropic : public material {
@@ -115,13 +132,17 @@ public:
 	isotropic(color c) : a(std::make_shared<solid_color>(c)) {}
 	isotropic(std::shared_ptr<texture> albedo) : a(albedo) {}
 
-	std::optional<scatter> scatter_check(const ray& r, const hit& rec) const override {
+	std::optional<scatter> scatter_check(const ray& r, const hit& rec, sampler& rng) const override {
 		scatter s{};
-		s.bounce = ray(rec.point, random_in_unit_sphere(), r.time());
+		s.bounce = ray(rec.point, random_in_unit_sphere(rng), r.time());
 		s.attenuation = a->value(rec.u, rec.v, rec.point);
 		return s;
 	};
 
+	double scattering_pdf(const ray& r, const hit& rec, const vec3& direction) const override {
+		return 1 / (4 * pi);
+	}
+
 private:
 	std::shared_ptr<texture> a;
 };
\ No newline at end of file
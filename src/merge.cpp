@@ -0,0 +1,93 @@
+// Combines the accumulation files of renders of disjoint sample ranges of one frame,
+// written by raytracer --first-sample <index> --accumulation <file>, into its image.
+// Each pixel's sums are divided by the samples all files took for it, so files with
+// different or adaptive sample counts, and unfinished ones, are weighted correctly.
+//
+// Usage: raytracer_merge [-o <file>] [--format <format>] <accumulation file>...
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "renderer.h"
+#include "image_io.h"
+#include "checkpoint.h"
+
+// Whether two renders sampled the same frame: everything but the sample range and how it was split into passes
+bool same_frame(const checkpoint& a, const checkpoint& b) {
+	const auto& s = a.settings;
+	const auto& t = b.settings;
+	return a.scene == b.scene && s.width == t.width && s.height == t.height && s.max_depth == t.max_depth && s.rr_depth == t.rr_depth
+		&& s.sample_lights == t.sample_lights && s.ao_radius == t.ao_radius && s.seed == t.seed;
+}
+
+int main(int argc, char* argv[]) {
+	std::string output_path = "-";
+	std::optional<image_format> output_format;
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if ((arg == "-o" || arg == "--output") && i + 1 < argc) output_path = argv[++i];
+		else if (arg == "--format" && i + 1 < argc) {
+			output_format = image_format_from_name(argv[++i]);
+			if (!output_format) {
+				std::cerr << "ERROR: Unknown image format " << argv[i] << ", expected p3, ppm, pfm or png.\n";
+				return 1;
+			}
+		}
+		else if (!arg.empty() && arg[0] != '-') inputs.push_back(arg);
+		else {
+			inputs.clear();
+			break;
+		}
+	}
+	if (inputs.empty()) {
+		std::cerr << "Usage: " << argv[0] << " [-o <file>] [--format <format>] <accumulation file>...\n";
+		return 1;
+	}
+
+	std::optional<checkpoint> merged;
+	std::vector<std::pair<int, int>> ranges;
+	for (const auto& path : inputs) {
+		auto part = load_checkpoint(path);
+		if (!part) return 1;
+		const auto& s = part->settings;
+		if (part->state.pass < int(pass_targets(s).size()))
+			std::cerr << path << " is unfinished, merging the " << part->state.buffer.total_samples() << " samples it has.\n";
+		ranges.emplace_back(s.first_sample, s.first_sample + s.samples_per_pixel);
+
+		if (!merged) {
+			merged = std::move(part);
+			continue;
+		}
+		if (!same_frame(*merged, *part)) {
+			std::cerr << "ERROR: " << path << " is a render of a different frame than " << inputs.front() << ".\n";
+			return 1;
+		}
+		auto& buffer = merged->state.buffer;
+		const auto& other = part->state.buffer;
+		for (size_t n = 0; n < buffer.sums.size(); ++n) {
+			buffer.sums[n] += other.sums[n];
+			buffer.counts[n] += other.counts[n];
+		}
+	}
+
+	// The same sample taken twice would not bias the image, but it would not be worth its weight either
+	std::sort(ranges.begin(), ranges.end());
+	for (size_t n = 1; n < ranges.size(); ++n)
+		if (ranges[n].first < ranges[n - 1].second) {
+			std::cerr << "ERROR: Sample ranges [" << ranges[n - 1].first << ", " << ranges[n - 1].second << ") and ["
+				<< ranges[n].first << ", " << ranges[n].second << ") overlap.\n";
+			return 1;
+		}
+
+	const auto& buffer = merged->state.buffer;
+	std::cerr << "Merged " << inputs.size() << " renders of " << merged->scene << ", "
+		<< double(buffer.total_samples()) / buffer.sums.size() << " samples per pixel on average.\n";
+	framebuffer_view image{ buffer.sums.data(), buffer.width, buffer.height, 1, buffer.counts.data() };
+	auto format = output_format ? *output_format : image_format_from_path(output_path).value_or(image_format::ppm);
+	return write_image(output_path, format, image) ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+
+// Orthonormal basis with w along a given direction, maps local coordinates to world space
+class onb {
+public:
+	explicit onb(const vec3& direction) {
+		axis[2] = unit_vector(direction);
+		vec3 a = fabs(axis[2].x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		axis[1] = unit_vector(cross(axis[2], a));
+		axis[0] = cross(axis[2], axis[1]);
+	}
+
+	vec3 u() const { return axis[0]; }
+	vec3 v() const { return axis[1]; }
+	vec3 w() const { return axis[2]; }
+
+	vec3 local(const vec3& a) const {
+		return a.x() * axis[0] + a.y() * axis[1] + a.z() * axis[2];
+	}
+
+private:
+	vec3 axis[3];
+};
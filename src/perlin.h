@@ -49,7 +49,7 @@ public:
 
 private:
 	static void perlin_generate_perm(std::array<int, point_count>& perm) {
-		for (int i = 0; i < perm.size(); ++i)
+		for (int i = 0; i < point_count; ++i)
 			perm[i] = i;
 		permute(perm);
 	}
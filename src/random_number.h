@@ -1,11 +1,30 @@
 #pragma once
 
-#include <random>
+#include "sampler.h"
+
+// The calling thread's sampler, used by code that is not handed one explicitly
+// (scene construction, participating media). Render threads bind their
+// per-sample sampler here through sampler_scope.
+inline sampler*& bound_sampler() {
+	thread_local sampler fallback;
+	thread_local sampler* bound = &fallback;
+	return bound;
+}
+
+class sampler_scope {
+public:
+	explicit sampler_scope(sampler& rng) : previous(bound_sampler()) { bound_sampler() = &rng; }
+	~sampler_scope() { bound_sampler() = previous; }
+
+	sampler_scope(const sampler_scope&) = delete;
+	sampler_scope& operator=(const sampler_scope&) = delete;
+
+private:
+	sampler* previous;
+};
 
 inline double random_double() {
-	static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-	static std::mt19937 generator;
-	return distribution(generator);
+	return bound_sampler()->next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "visible.h"
+
+constexpr int path_length_buckets = 17; // Paths that hit 0..15 surfaces, then 16 or more
+
+const char* primitive_type_name(primitive_type type) {
+	static const char* names[primitive_type_count] = { "sphere", "moving_sphere", "xy_rect", "xz_rect", "yz_rect", "constant_medium", "other" };
+	return names[static_cast<int>(type)];
+}
+
+// Totals of a render, summed over its threads
+struct render_counters {
+	uint64_t camera_rays = 0;
+	uint64_t secondary_rays = 0; // Bounces after the camera ray
+	uint64_t shadow_rays = 0; // Towards sampled lights and ambient occlusion probes
+	uint64_t nodes_visited = 0;
+	uint64_t primitive_tests = 0;
+	uint64_t hits[primitive_type_count] = {};
+	uint64_t path_lengths[path_length_buckets] = {}; // By the number of surfaces a path hit
+
+	uint64_t rays() const { return camera_rays + secondary_rays + shadow_rays; }
+	std::string json() const;
+};
+
+std::string render_counters::json() const {
+	std::ostringstream out;
+	out << "{\"camera_rays\":" << camera_rays << ",\"secondary_rays\":" << secondary_rays << ",\"shadow_rays\":" << shadow_rays
+		<< ",\"nodes_visited\":" << nodes_visited << ",\"primitive_tests\":" << primitive_tests << ",\"hits\":{";
+	for (int type = 0; type < primitive_type_count; ++type)
+		out << (type > 0 ? "," : "") << '"' << primitive_type_name(static_cast<primitive_type>(type)) << "\":" << hits[type];
+	out << "},\"path_lengths\":[";
+	for (int length = 0; length < path_length_buckets; ++length)
+		out << (length > 0 ? "," : "") << path_lengths[length];
+	out << "]}";
+	return out.str();
+}
+
+// One thread's live counters. Only the owning thread writes them, with a relaxed load and
+// store rather than an atomic increment, so counting costs as much as a plain add while a
+// reporter thread reads them. A cache line each keeps threads from sharing one.
+struct alignas(64) thread_counters {
+	std::atomic<uint64_t> camera_rays{ 0 };
+	std::atomic<uint64_t> secondary_rays{ 0 };
+	std::atomic<uint64_t> shadow_rays{ 0 };
+	std::atomic<uint64_t> nodes_visited{ 0 };
+	std::atomic<uint64_t> primitive_tests{ 0 };
+	std::atomic<uint64_t> hits[primitive_type_count] = {};
+	std::atomic<uint64_t> path_lengths[path_length_buckets] = {};
+
+	static void add(std::atomic<uint64_t>& counter, uint64_t amount) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	void add_to(render_counters& totals) const;
+};
+
+void thread_counters::add_to(render_counters& totals) const {
+	auto read = [](const std::atomic<uint64_t>& counter) { return counter.load(std::memory_order_relaxed); };
+	totals.camera_rays += read(camera_rays);
+	totals.secondary_rays += read(secondary_rays);
+	totals.shadow_rays += read(shadow_rays);
+	totals.nodes_visited += read(nodes_visited);
+	totals.primitive_tests += read(primitive_tests);
+	for (int type = 0; type < primitive_type_count; ++type)
+		totals.hits[type] += read(hits[type]);
+	for (int length = 0; length < path_length_buckets; ++length)
+		totals.path_lengths[length] += read(path_lengths[length]);
+}
+
+// The counters a render's code adds to on this thread, null when nothing is counted
+inline thread_counters*& bound_counters() {
+	static thread_local thread_counters* bound = nullptr;
+	return bound;
+}
+
+class counters_scope {
+public:
+	explicit counters_scope(thread_counters& counters) : previous(bound_counters()) { bound_counters() = &counters; }
+	~counters_scope() { bound_counters() = previous; }
+
+	counters_scope(const counters_scope&) = delete;
+	counters_scope& operator=(const counters_scope&) = delete;
+
+private:
+	thread_counters* previous;
+};
+
+// A traversal's work, counted in locals and added to the thread's counters when it ends
+struct traversal_count {
+	uint64_t nodes = 0;
+	uint64_t tests = 0;
+
+	~traversal_count() {
+		if (auto* counters = bound_counters()) {
+			thread_counters::add(counters->nodes_visited, nodes);
+			thread_counters::add(counters->primitive_tests, tests);
+		}
+	}
+};
+
+// A slot per pool worker, plus one shared by threads outside the pool
+class counter_set {
+public:
+	explicit counter_set(size_t workers) : slots(workers + 1) {}
+
+	thread_counters& slot(int worker) { return worker >= 0 && size_t(worker) + 1 < slots.size() ? slots[worker] : slots.back(); }
+
+	render_counters totals() const {
+		render_counters totals;
+		for (const auto& counters : slots)
+			counters.add_to(totals);
+		return totals;
+	}
+
+private:
+	std::vector<thread_counters> slots;
+};
@@ -0,0 +1,766 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include "common.h"
+#include "camera.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "render_counters.h"
+#include "random_number.h"
+#include "sampler.h"
+#include "thread_pool.h"
+#include "visible_collection.h"
+#include "wide_bvh.h"
+
+// Multiple importance sampling weight of a strategy with density `pdf` against one with `other`
+inline double power_heuristic(double pdf, double other) {
+	auto a = pdf * pdf;
+	auto b = other * other;
+	return a / (a + b);
+}
+
+// Iterative path tracer. `throughput` is the product of the attenuations along the
+// path; from bounce `rr_depth` on, a path survives with probability equal to its
+// largest throughput channel and is reweighted by the inverse, which keeps the
+// estimate unbiased while cutting the long tails that contribute almost nothing.
+//
+// At every non-specular vertex one direction towards `lights` is sampled as well
+// (next-event estimation). Emission found by either strategy is weighted with the
+// power heuristic, so each light path is counted once. An empty `lights` gives
+// plain BSDF sampling. `primary` is the camera ray's intersection when a packet
+// already traced it.
+color ray_color(ray r, const visible& world, const visible_collection& lights, int max_depth, int rr_depth, sampler& rng, uint64_t& rays, const intersection* primary = nullptr) {
+	auto counters = bound_counters();
+	uint64_t segments = 0, shadow_rays = 0;
+	int surfaces = 0;
+	color radiance(0, 0, 0);
+	color throughput(1, 1, 1);
+	vec3 previous_point;
+	double bsdf_pdf = 0; // Of the direction that led here, 0 for camera rays and specular bounces
+	for (int depth = 0; depth < max_depth; ++depth) {
+		++segments;
+		intersection isect;
+		if (depth == 0 && primary) {
+			if (!primary->object) break;
+			isect = *primary;
+		}
+		else if (!world.intersect(r, 0.001, infinity, isect)) break; // Black background
+		auto rec = isect.surface(r);
+		++surfaces;
+		if (counters) thread_counters::add(counters->hits[static_cast<int>(isect.object->type())], 1);
+
+		auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.point);
+		if (emitted.max_component() > 0) {
+			double weight = 1;
+			if (bsdf_pdf > 0 && !lights.empty())
+				weight = power_heuristic(bsdf_pdf, lights.pdf_value(previous_point, r.direction()));
+			radiance += weight * throughput * emitted;
+		}
+
+		auto scatter = rec.mat_ptr->scatter_check(r, rec, rng);
+		if (!scatter) break;
+
+		auto next_pdf = rec.mat_ptr->scattering_pdf(r, rec, scatter->bounce.direction());
+		if (next_pdf > 0 && !lights.empty()) {
+			auto direction = lights.random(rec.point, rng);
+			auto light_pdf = lights.pdf_value(rec.point, direction);
+			auto scattering_pdf = light_pdf > 0 ? rec.mat_ptr->scattering_pdf(r, rec, direction) : 0;
+			if (scattering_pdf > 0) {
+				// The nearest light along the sample, then a visibility test up to it.
+				// Emitters that are not in `lights` count as occluders.
+				ray shadow(rec.point, direction, r.time());
+				intersection light_isect;
+				++shadow_rays;
+				if (lights.intersect(shadow, 0.001, infinity, light_isect) && !world.occluded(shadow, 0.001, light_isect.t * (1 - 1e-9))) {
+					auto light = light_isect.surface(shadow);
+					auto light_emitted = light.mat_ptr->emitted(light.u, light.v, light.point);
+					auto weight = power_heuristic(light_pdf, scattering_pdf);
+					radiance += (weight * scattering_pdf / light_pdf) * throughput * scatter->attenuation * light_emitted;
+				}
+			}
+		}
+
+		bsdf_pdf = next_pdf;
+		previous_point = rec.point;
+		throughput = throughput * scatter->attenuation;
+		auto survival = std::min(throughput.max_component(), 1.0);
+		if (survival <= 0) break;
+		if (depth + 1 >= rr_depth) {
+			if (rng.next_double() >= survival) break;
+			throughput /= survival;
+		}
+		r = scatter->bounce;
+	}
+
+	rays += segments + shadow_rays;
+	if (counters) {
+		thread_counters::add(counters->camera_rays, 1);
+		thread_counters::add(counters->secondary_rays, segments > 0 ? segments - 1 : 0);
+		thread_counters::add(counters->shadow_rays, shadow_rays);
+		thread_counters::add(counters->path_lengths[std::min(surfaces, path_length_buckets - 1)], 1);
+	}
+	return radiance;
+}
+
+// Ambient occlusion preview: white where a cosine weighted direction above the first
+// hit escapes within `radius`, black where it is blocked. Misses count as open sky.
+color ambient_occlusion(const ray& r, const visible& world, double radius, sampler& rng, uint64_t& rays, const intersection* primary = nullptr) {
+	auto counters = bound_counters();
+	if (counters) thread_counters::add(counters->camera_rays, 1);
+	++rays;
+	intersection isect;
+	if (primary)
+		isect = *primary;
+	else
+		world.intersect(r, 0.001, infinity, isect);
+	if (!isect.object) return color(1, 1, 1);
+	auto rec = isect.surface(r);
+	if (counters) {
+		thread_counters::add(counters->hits[static_cast<int>(isect.object->type())], 1);
+		thread_counters::add(counters->shadow_rays, 1);
+	}
+
+	auto direction = rec.normal + random_unit_vector(rng);
+	if (direction.near_zero()) direction = rec.normal;
+	++rays;
+	bool blocked = world.occluded(ray(rec.point, unit_vector(direction), r.time()), 0.001, radius);
+	return blocked ? color(0, 0, 0) : color(1, 1, 1);
+}
+
+enum class render_integrator { recursive, wavefront };
+
+struct render_settings {
+	int width = 800;
+	int height = 800;
+	int samples_per_pixel = 100; // The cap per pixel when sampling adaptively
+	int first_sample = 0; // Index of every pixel's first sample, so renders of disjoint ranges can be merged
+	int max_depth = 50;
+	int rr_depth = 3; // Bounces before Russian roulette may end a path, max_depth or more disables it
+	bool sample_lights = true; // Next-event estimation towards the scene's lights
+	double ao_radius = 0; // Renders an ambient occlusion preview with this radius instead of paths when positive
+	double adaptive_threshold = 0; // accumulation_buffer::relative_error() under which a pixel stops sampling, 0 samples every pixel fully
+	int adaptive_pass = 16; // Samples per pixel added by each adaptive pass, also the minimum per pixel
+	bool progressive = false; // Passes of 1, 2, 4... samples per pixel over the whole frame
+	bvh_layout bvh = bvh_layout::binary; // Of the BVH the frame is traced through, resolved before rendering
+	int packet_size = 0; // Traces camera rays in packets of this many pixels square, at most 16, 0 one at a time
+	render_integrator integrator = render_integrator::recursive;
+	int wavefront_batch = 1024; // Paths the wavefront integrator takes through each stage together
+	bool reorder_rays = false; // Sorts the wavefront's bounces by direction and origin before tracing them
+	double time_budget = 0; // Seconds after which no more tiles start, 0 for no limit
+	uint64_t seed = 0; // Also the frame index every sample's random stream is derived from
+	bool progress = true; // Tiles remaining on stderr
+};
+
+struct render_stats {
+	double seconds = 0;
+	uint64_t rays = 0;
+	uint64_t samples = 0;
+	int passes = 0;
+	bool out_of_time = false; // The time budget ran out before the last pass finished
+	bool interrupted = false; // Stopped on request before the last pass finished
+	render_counters counters;
+};
+
+inline double luminance(const color& c) {
+	return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Per-pixel sample sums and counts, top row first, with the running sum of squared
+// deviations of each pixel's luminance (Welford's method) for variance estimates
+struct accumulation_buffer {
+	int width = 0;
+	int height = 0;
+	std::vector<color> sums;
+	std::vector<uint32_t> counts;
+	std::vector<double> m2;
+
+	void reset(int w, int h);
+	void add(size_t pixel, const color& sample);
+	double relative_error(size_t pixel) const;
+	uint64_t total_samples() const;
+};
+
+void accumulation_buffer::reset(int w, int h) {
+	width = w;
+	height = h;
+	sums.assign(size_t(w) * h, color(0, 0, 0));
+	counts.assign(size_t(w) * h, 0);
+	m2.assign(size_t(w) * h, 0.0);
+}
+
+void accumulation_buffer::add(size_t pixel, const color& sample) {
+	auto count = ++counts[pixel];
+	auto previous_mean = count > 1 ? luminance(sums[pixel]) / (count - 1) : 0.0;
+	sums[pixel] += sample;
+	auto y = luminance(sample);
+	m2[pixel] += (y - previous_mean) * (y - luminance(sums[pixel]) / count);
+}
+
+// Standard error of the pixel's displayed value: the error of its mean luminance relative
+// to the square root of that mean, the derivative of the gamma 2 output. Pixels that
+// stay saturated white within two standard errors count as converged.
+double accumulation_buffer::relative_error(size_t pixel) const {
+	auto count = counts[pixel];
+	if (count < 2) return infinity;
+	auto mean = luminance(sums[pixel]) / count;
+	auto standard_error = std::sqrt(m2[pixel] / (count - 1) / count);
+	if (mean - 2 * standard_error >= 1) return 0;
+	return standard_error / (2 * std::sqrt(std::max(mean, 1e-4)));
+}
+
+uint64_t accumulation_buffer::total_samples() const {
+	uint64_t total = 0;
+	for (auto count : counts)
+		total += count;
+	return total;
+}
+
+struct tile {
+	int x0, y0, x1, y1;
+};
+
+std::vector<tile> make_tiles(int width, int height, int tile_size) {
+	std::vector<tile> tiles;
+	for (int y = 0; y < height; y += tile_size)
+		for (int x = 0; x < width; x += tile_size)
+			tiles.push_back({ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+	return tiles;
+}
+
+struct tile_result {
+	uint64_t rays = 0;
+	uint64_t samples = 0;
+};
+
+// render_tile tracing the camera rays of each block of packet_size x packet_size pixels
+// as a packet. The pixels of a block furthest behind take their next sample together,
+// each from its own random stream as always, so only media, which draw their distances
+// while the packet is traversed in its own order, can make a difference to the image.
+tile_result render_tile_packets(
+	const tile& t, accumulation_buffer& buffer, int target_samples, const uint8_t* active, const render_settings& settings,
+	const camera& cam, const visible& world, const visible_collection& lights
+) {
+	const int width = settings.width, height = settings.height;
+	const int block = std::clamp(settings.packet_size, 1, 16);
+	auto packet = std::make_unique<ray_packet>();
+	std::vector<sampler> streams(block * block);
+	std::vector<size_t> pixels(block * block);
+	const std::vector<uint8_t> all(ray_packet::max_size, 1);
+	tile_result result;
+	for (int by = t.y0; by < t.y1; by += block)
+		for (int bx = t.x0; bx < t.x1; bx += block) {
+			const int x1 = std::min(bx + block, t.x1), y1 = std::min(by + block, t.y1);
+			for (;;) {
+				int s = target_samples;
+				for (int j = by; j < y1; ++j)
+					for (int i = bx; i < x1; ++i) {
+						size_t pixel = size_t(j) * width + i;
+						if (!active || active[pixel]) s = std::min(s, int(buffer.counts[pixel]));
+					}
+				if (s >= target_samples) break;
+
+				packet->clear();
+				for (int j = by; j < y1; ++j) {
+					int k = height - 1 - j; // Top to bottom
+					for (int i = bx; i < x1; ++i) {
+						size_t pixel = size_t(j) * width + i;
+						if ((active && !active[pixel]) || int(buffer.counts[pixel]) != s) continue;
+						auto& rng = streams[packet->size];
+						rng.reseed(pixel, settings.first_sample + s, settings.seed);
+						auto u = (i + rng.next_double()) / (width - 1);
+						auto v = (k + rng.next_double()) / (height - 1);
+						pixels[packet->size] = pixel;
+						packet->add(cam.get_ray(u, v, rng), rng);
+					}
+				}
+				packet->prepare();
+				world.intersect_packet(*packet, 0, packet->size, all.data());
+
+				for (int n = 0; n < packet->size; ++n) {
+					auto& rng = streams[n];
+					sampler_scope bind(rng);
+					const auto& r = packet->rays[n];
+					if (settings.ao_radius > 0)
+						buffer.add(pixels[n], ambient_occlusion(r, world, settings.ao_radius, rng, result.rays, &packet->isects[n]));
+					else
+						buffer.add(pixels[n], ray_color(r, world, lights, settings.max_depth, settings.rr_depth, rng, result.rays, &packet->isects[n]));
+					++result.samples;
+				}
+			}
+		}
+	return result;
+}
+
+// Spreads the low 10 bits of x to every third bit
+inline uint32_t morton_spread(uint32_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+// Sorting rays by this key groups those that point into the same octant, then those
+// whose origins are close along a Morton curve through `bounds`, so consecutive
+// traversals descend the same way through the same nodes
+inline uint64_t ray_order_key(const ray& r, const aabb& bounds) {
+	uint64_t key = 0;
+	for (int a = 0; a < 3; ++a) {
+		auto extent = bounds.max()[a] - bounds.min()[a];
+		auto cell = extent > 0 ? (r.origin()[a] - bounds.min()[a]) / extent * 1024 : 0.0;
+		key |= morton_spread(static_cast<uint32_t>(std::clamp(cell, 0.0, 1023.0))) << a;
+	}
+	int octant = (r.direction().x() < 0) | (r.direction().y() < 0) << 1 | (r.direction().z() < 0) << 2;
+	return uint64_t(octant) << 30 | key;
+}
+
+// A path of the wavefront integrator between stages: what ray_color keeps in locals, the
+// vertex being shaded and the shadow ray it is waiting on
+struct wavefront_path {
+	ray r;
+	sampler rng;
+	size_t pixel;
+	color radiance, throughput;
+	vec3 previous_point;
+	double bsdf_pdf;
+	int depth, surfaces;
+	uint32_t segments, shadow_rays;
+	hit rec;
+	uint64_t sort_key; // For the stage that sorts the batch next
+	scatter bounce;
+	double next_pdf;
+	bool shadow_pending;
+	ray shadow;
+	double shadow_t;
+	color shadow_contribution;
+};
+
+// render_tile with the paths of up to wavefront_batch samples at once, taken stage by stage
+// as ray_color takes a single path: intersect them all, sort the hits by material, shade
+// them, trace the shadow rays, then spawn the bounces that survive. Each shading kernel
+// then runs over a run of hits of one material instead of whatever the last path hit.
+// Every path keeps its own random stream and draws from it in ray_color's order, and
+// samples reach the buffer in render_tile's order, so the image is the same. With
+// reorder_rays the bounces are also sorted by ray_order_key() before they are traced.
+tile_result render_tile_wavefront(
+	const tile& t, accumulation_buffer& buffer, int target_samples, const uint8_t* active, const render_settings& settings,
+	const camera& cam, const visible& world, const visible_collection& lights
+) {
+	const int width = settings.width, height = settings.height;
+	const size_t batch = std::max(settings.wavefront_batch, 1);
+	auto counters = bound_counters();
+	std::vector<wavefront_path> paths;
+	paths.reserve(batch);
+	std::vector<uint32_t> live, next;
+	std::vector<const std::type_info*> kinds; // Material types seen, numbered in order
+	const auto world_box = settings.reorder_rays ? world.bounding_box(0, 1) : std::nullopt;
+	tile_result result;
+
+	// Ends a path the way ray_color returns
+	auto finish = [&](wavefront_path& path) {
+		result.rays += path.segments + path.shadow_rays;
+		if (counters) {
+			thread_counters::add(counters->camera_rays, 1);
+			thread_counters::add(counters->secondary_rays, path.segments > 0 ? path.segments - 1 : 0);
+			thread_counters::add(counters->shadow_rays, path.shadow_rays);
+			thread_counters::add(counters->path_lengths[std::min(path.surfaces, path_length_buckets - 1)], 1);
+		}
+	};
+
+	auto trace = [&] {
+		live.clear();
+		for (uint32_t n = 0; n < paths.size(); ++n) {
+			if (settings.max_depth > 0) live.push_back(n);
+			else finish(paths[n]);
+		}
+		for (int bounce = 0; !live.empty(); ++bounce) {
+			// Camera rays start out in pixel order, which is coherent already
+			if (world_box && bounce > 0) {
+				for (auto n : live)
+					paths[n].sort_key = ray_order_key(paths[n].r, *world_box);
+				std::sort(live.begin(), live.end(), [&](uint32_t a, uint32_t b) { return paths[a].sort_key < paths[b].sort_key; });
+			}
+
+			// Intersect, dropping the paths that escape
+			next.clear();
+			for (auto n : live) {
+				auto& path = paths[n];
+				sampler_scope bind(path.rng);
+				++path.segments;
+				intersection isect;
+				if (!world.intersect(path.r, 0.001, infinity, isect)) {
+					finish(path);
+					continue;
+				}
+				path.rec = isect.surface(path.r);
+				++path.surfaces;
+				if (counters) thread_counters::add(counters->hits[static_cast<int>(isect.object->type())], 1);
+				next.push_back(n);
+			}
+			live.swap(next);
+
+			// Sort by material
+			for (auto n : live) {
+				auto& path = paths[n];
+				const auto& kind = typeid(*path.rec.mat_ptr);
+				size_t k = 0;
+				while (k < kinds.size() && *kinds[k] != kind)
+					++k;
+				if (k == kinds.size()) kinds.push_back(&kind);
+				path.sort_key = uint64_t(k) << 48 | (reinterpret_cast<uintptr_t>(path.rec.mat_ptr) & ((uint64_t(1) << 48) - 1));
+			}
+			std::sort(live.begin(), live.end(), [&](uint32_t a, uint32_t b) { return paths[a].sort_key < paths[b].sort_key; });
+
+			// Shade: emission, the bounce and the light sample
+			next.clear();
+			for (auto n : live) {
+				auto& path = paths[n];
+				sampler_scope bind(path.rng);
+				const auto& r = path.r;
+				const auto& rec = path.rec;
+				auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.point);
+				if (emitted.max_component() > 0) {
+					double weight = 1;
+					if (path.bsdf_pdf > 0 && !lights.empty())
+						weight = power_heuristic(path.bsdf_pdf, lights.pdf_value(path.previous_point, r.direction()));
+					path.radiance += weight * path.throughput * emitted;
+				}
+
+				auto scatter = rec.mat_ptr->scatter_check(r, rec, path.rng);
+				if (!scatter) {
+					finish(path);
+					continue;
+				}
+				path.bounce = *scatter;
+				path.next_pdf = rec.mat_ptr->scattering_pdf(r, rec, scatter->bounce.direction());
+				path.shadow_pending = false;
+				if (path.next_pdf > 0 && !lights.empty()) {
+					auto direction = lights.random(rec.point, path.rng);
+					auto light_pdf = lights.pdf_value(rec.point, direction);
+					auto scattering_pdf = light_pdf > 0 ? rec.mat_ptr->scattering_pdf(r, rec, direction) : 0;
+					if (scattering_pdf > 0) {
+						path.shadow = ray(rec.point, direction, r.time());
+						intersection light_isect;
+						++path.shadow_rays;
+						if (lights.intersect(path.shadow, 0.001, infinity, light_isect)) {
+							auto light = light_isect.surface(path.shadow);
+							auto light_emitted = light.mat_ptr->emitted(light.u, light.v, light.point);
+							auto weight = power_heuristic(light_pdf, scattering_pdf);
+							path.shadow_pending = true;
+							path.shadow_t = light_isect.t * (1 - 1e-9);
+							path.shadow_contribution = (weight * scattering_pdf / light_pdf) * path.throughput * scatter->attenuation * light_emitted;
+						}
+					}
+				}
+				next.push_back(n);
+			}
+			live.swap(next);
+
+			// Shadow rays
+			for (auto n : live) {
+				auto& path = paths[n];
+				if (!path.shadow_pending) continue;
+				sampler_scope bind(path.rng);
+				if (!world.occluded(path.shadow, 0.001, path.shadow_t)) path.radiance += path.shadow_contribution;
+			}
+
+			// Spawn the bounces of the paths that survive Russian roulette
+			next.clear();
+			for (auto n : live) {
+				auto& path = paths[n];
+				path.bsdf_pdf = path.next_pdf;
+				path.previous_point = path.rec.point;
+				path.throughput = path.throughput * path.bounce.attenuation;
+				auto survival = std::min(path.throughput.max_component(), 1.0);
+				bool alive = survival > 0 && path.depth + 1 < settings.max_depth;
+				if (alive && path.depth + 1 >= settings.rr_depth) {
+					if (path.rng.next_double() >= survival) alive = false;
+					else path.throughput /= survival;
+				}
+				if (!alive) {
+					finish(path);
+					continue;
+				}
+				path.r = path.bounce.bounce;
+				++path.depth;
+				next.push_back(n);
+			}
+			live.swap(next);
+		}
+
+		// In the order the paths were started, so every pixel's statistics match render_tile's
+		for (const auto& path : paths) {
+			buffer.add(path.pixel, path.radiance);
+			++result.samples;
+		}
+		paths.clear();
+	};
+
+	for (int j = t.y0; j < t.y1; ++j) {
+		int k = height - 1 - j; // Top to bottom
+		for (int i = t.x0; i < t.x1; ++i) {
+			size_t pixel = size_t(j) * width + i;
+			if (active && !active[pixel]) continue;
+			for (int s = buffer.counts[pixel]; s < target_samples; ++s) {
+				auto& path = paths.emplace_back();
+				path.rng.reseed(pixel, settings.first_sample + s, settings.seed);
+				auto u = (i + path.rng.next_double()) / (width - 1);
+				auto v = (k + path.rng.next_double()) / (height - 1);
+				path.r = cam.get_ray(u, v, path.rng);
+				path.pixel = pixel;
+				path.radiance = color(0, 0, 0);
+				path.throughput = color(1, 1, 1);
+				path.bsdf_pdf = 0;
+				path.depth = path.surfaces = 0;
+				path.segments = path.shadow_rays = 0;
+				if (paths.size() == batch) trace();
+			}
+		}
+	}
+	if (!paths.empty()) trace();
+	return result;
+}
+
+// Brings the tile's pixels up to `target_samples`, only those set in `active` if given.
+// A pixel's samples are always indices 0, 1, 2... of its random streams, so the
+// result does not depend on how the samples were split into passes.
+tile_result render_tile(
+	const tile& t, accumulation_buffer& buffer, int target_samples, const uint8_t* active, const render_settings& settings,
+	const camera& cam, const visible& world, const visible_collection& lights
+) {
+	if (settings.integrator == render_integrator::wavefront && settings.ao_radius <= 0)
+		return render_tile_wavefront(t, buffer, target_samples, active, settings, cam, world, lights);
+	if (settings.packet_size > 0) return render_tile_packets(t, buffer, target_samples, active, settings, cam, world, lights);
+	const int width = settings.width, height = settings.height;
+	sampler rng;
+	sampler_scope bind(rng);
+	tile_result result;
+	for (int j = t.y0; j < t.y1; ++j) {
+		int k = height - 1 - j; // Top to bottom
+		for (int i = t.x0; i < t.x1; ++i) {
+			size_t pixel = size_t(j) * width + i;
+			if (active && !active[pixel]) continue;
+			for (int s = buffer.counts[pixel]; s < target_samples; ++s) {
+				rng.reseed(static_cast<uint64_t>(j) * width + i, settings.first_sample + s, settings.seed);
+				auto u = (i + rng.next_double()) / (width - 1);
+				auto v = (k + rng.next_double()) / (height - 1);
+				ray r = cam.get_ray(u, v, rng);
+				if (settings.ao_radius > 0)
+					buffer.add(pixel, ambient_occlusion(r, world, settings.ao_radius, rng, result.rays));
+				else
+					buffer.add(pixel, ray_color(r, world, lights, settings.max_depth, settings.rr_depth, rng, result.rays));
+				++result.samples;
+			}
+		}
+	}
+	return result;
+}
+
+// Marks the pixels that are not converged yet. A pixel keeps sampling while any pixel of
+// its 3x3 neighbourhood is above the threshold: a few samples of a pixel lit by rare
+// paths often all miss, and its neighbours are the only sign that it is not done.
+void mark_unconverged(const accumulation_buffer& buffer, double threshold, int cap, std::vector<uint8_t>& active) {
+	std::vector<uint8_t> noisy(buffer.sums.size());
+	for (size_t n = 0; n < noisy.size(); ++n)
+		noisy[n] = buffer.relative_error(n) >= threshold;
+	active.assign(noisy.size(), 0);
+	for (int y = 0; y < buffer.height; ++y)
+		for (int x = 0; x < buffer.width; ++x) {
+			size_t n = size_t(y) * buffer.width + x;
+			if (buffer.counts[n] >= uint32_t(cap)) continue;
+			for (int dy = std::max(y - 1, 0); dy <= std::min(y + 1, buffer.height - 1) && !active[n]; ++dy)
+				for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, buffer.width - 1); ++dx)
+					if (noisy[size_t(dy) * buffer.width + dx]) {
+						active[n] = 1;
+						break;
+					}
+		}
+}
+
+// Sample count each pass brings the pixels up to: a single pass by default, steps of
+// adaptive_pass when sampling adaptively, and 1, 2, 4... when rendering progressively
+std::vector<int> pass_targets(const render_settings& settings) {
+	std::vector<int> targets;
+	const int cap = settings.samples_per_pixel;
+	if (settings.progressive) {
+		for (int target = 1; target < cap; target *= 2)
+			targets.push_back(target);
+	}
+	else if (settings.adaptive_threshold > 0) {
+		const int step = std::max(settings.adaptive_pass, 2);
+		for (int target = step; target < cap; target += step)
+			targets.push_back(target);
+	}
+	targets.push_back(cap);
+	return targets;
+}
+
+// Where a render stands, enough to continue it exactly: the frame so far, the pass it is
+// in and, when sampling adaptively, that pass's pixel mask. The random streams need no
+// saving, every sample reseeds from its pixel, index and frame.
+struct render_state {
+	int pass = 0;
+	std::vector<uint8_t> active; // Empty for all pixels
+	accumulation_buffer buffer;
+
+	void reset(int width, int height) {
+		pass = 0;
+		active.clear();
+		buffer.reset(width, height);
+	}
+};
+
+// Called between passes with the frame so far, for snapshots
+using pass_callback = std::function<void(const accumulation_buffer&, const render_stats&)>;
+
+struct render_hooks {
+	pass_callback on_pass;
+	// Receives a consistent copy of the state every checkpoint_interval seconds, on a helper thread
+	std::function<void(const render_state&)> on_checkpoint;
+	double checkpoint_interval = 0;
+	const std::atomic_bool* stop = nullptr; // Once set, for instance by a signal handler, no more tiles start
+};
+
+// Renders the frame on the pool, continuing `state` from its pass (reset() it for a new
+// frame). Passes follow pass_targets(). Once the time budget is spent or a stop is
+// requested no more tiles start, so a frame cut short has whole tiles with fewer
+// samples, which the per-pixel counts account for, and `state` can be resumed later.
+render_stats render(const camera& cam, const visible& world, const visible_collection& lights, const render_settings& settings, thread_pool& pool, render_state& state, const render_hooks& hooks = {}) {
+	auto& buffer = state.buffer;
+	const visible_collection no_lights;
+	const auto& sampled_lights = settings.sample_lights ? lights : no_lights;
+	const bool adaptive = settings.adaptive_threshold > 0;
+	const auto targets = pass_targets(settings);
+	const int first_pass = state.pass;
+
+	// Each worker starts with a contiguous band of tiles, idle workers steal the rest
+	constexpr int tile_size = 16;
+	auto tiles = make_tiles(settings.width, settings.height, tile_size);
+	std::vector<std::mutex> tile_locks(tiles.size()); // Held while a tile renders, so checkpoints copy whole tiles
+	std::atomic<uint64_t> rays{ 0 };
+	std::atomic<uint64_t> samples{ 0 };
+	std::atomic_bool cut_short{ false };
+	counter_set counters(pool.size());
+	render_stats stats;
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+	// Guards state.pass and state.active, which change between passes
+	std::mutex state_mutex;
+	std::condition_variable finished_changed;
+	bool finished = false;
+	std::thread checkpointer;
+	if (hooks.on_checkpoint && hooks.checkpoint_interval > 0)
+		checkpointer = std::thread([&] {
+			std::unique_lock lock(state_mutex);
+			auto interval = std::chrono::duration<double>(hooks.checkpoint_interval);
+			while (!finished_changed.wait_for(lock, interval, [&] { return finished; })) {
+				render_state copy;
+				copy.pass = state.pass;
+				copy.active = state.active;
+				copy.buffer.reset(buffer.width, buffer.height);
+				for (size_t n = 0; n < tiles.size(); ++n) {
+					std::lock_guard tile_lock(tile_locks[n]);
+					for (int y = tiles[n].y0; y < tiles[n].y1; ++y)
+						for (size_t i = size_t(y) * buffer.width + tiles[n].x0; i < size_t(y) * buffer.width + tiles[n].x1; ++i) {
+							copy.buffer.sums[i] = buffer.sums[i];
+							copy.buffer.counts[i] = buffer.counts[i];
+							copy.buffer.m2[i] = buffer.m2[i];
+						}
+				}
+				lock.unlock();
+				hooks.on_checkpoint(copy);
+				lock.lock();
+			}
+		});
+
+	// Progress from one thread at a fixed interval, rather than from every tile through the stream
+	// lock. Adaptive renders may stop well short of the cap, their ETA is an upper bound.
+	std::thread reporter;
+	if (settings.progress)
+		reporter = std::thread([&] {
+			const double start_samples = double(buffer.total_samples());
+			const double cap_samples = double(settings.width) * settings.height * settings.samples_per_pixel;
+			uint64_t last_rays = 0;
+			auto last = start;
+			bool reported = false;
+			std::unique_lock lock(state_mutex);
+			while (!finished_changed.wait_for(lock, std::chrono::milliseconds(500), [&] { return finished; })) {
+				auto totals = counters.totals();
+				auto now = std::chrono::steady_clock::now();
+				auto mrays = (totals.rays() - last_rays) / std::chrono::duration<double>(now - last).count() / 1e6;
+				last_rays = totals.rays();
+				last = now;
+				auto done = start_samples + totals.camera_rays;
+				auto seconds_left = totals.camera_rays > 0 ? elapsed() * (cap_samples - done) / totals.camera_rays : 0.0;
+				std::cerr << '\r';
+				if (targets.size() > 1) std::cerr << "Pass " << std::min(state.pass + 1, int(targets.size())) << '/' << targets.size() << ", ";
+				std::cerr << int(100 * done / cap_samples) << "% of samples, " << mrays << " Mrays/s, ETA " << (adaptive ? "at most " : "")
+					<< int(seconds_left + 0.5) << "s   " << std::flush;
+				reported = true;
+			}
+			if (reported) std::cerr << "\n";
+		});
+
+	// state.pass and the mask of the pass move on together as soon as a pass is done, so a
+	// checkpoint never saves a finished pass as the one in progress. A resumed pass keeps
+	// the mask it was saved with.
+	for (int pass = first_pass; pass < int(targets.size()) && !cut_short; ++pass) {
+		std::atomic<uint64_t> pass_samples_taken{ 0 };
+		task_group group;
+		for (size_t n = 0; n < tiles.size(); ++n)
+			pool.submit(group, [&, n, pass] {
+				if (cut_short || (hooks.stop && *hooks.stop) || (settings.time_budget > 0 && elapsed() >= settings.time_budget)) {
+					cut_short = true;
+					return;
+				}
+				std::lock_guard tile_lock(tile_locks[n]);
+				counters_scope bind(counters.slot(thread_pool::current_worker()));
+				auto result = render_tile(tiles[n], buffer, targets[pass], state.active.empty() ? nullptr : state.active.data(), settings, cam, world, sampled_lights);
+				rays += result.rays;
+				pass_samples_taken += result.samples;
+			}, n * pool.size() / tiles.size());
+		pool.wait(group);
+		samples += pass_samples_taken;
+		stats.passes = pass + 1;
+		stats.seconds = elapsed();
+		stats.rays = rays;
+		stats.samples = samples;
+		if (cut_short) break;
+		{
+			std::lock_guard lock(state_mutex);
+			state.pass = pass + 1;
+			if (adaptive && pass + 1 < int(targets.size())) mark_unconverged(buffer, settings.adaptive_threshold, settings.samples_per_pixel, state.active);
+		}
+		if (hooks.on_pass) hooks.on_pass(buffer, stats);
+		// Every pixel converged, unless this is a resumed pass that was done before its checkpoint
+		if (pass_samples_taken == 0 && pass > first_pass) break;
+	}
+	{
+		std::lock_guard lock(state_mutex);
+		if (!cut_short) state.pass = int(targets.size());
+		finished = true;
+	}
+	finished_changed.notify_all();
+	if (checkpointer.joinable()) checkpointer.join();
+	if (reporter.joinable()) reporter.join();
+
+	stats.out_of_time = cut_short && !(hooks.stop && *hooks.stop);
+	stats.interrupted = cut_short && hooks.stop && *hooks.stop;
+	stats.seconds = elapsed();
+	stats.counters = counters.totals();
+	return stats;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+// xoshiro256+ generator, 32 bytes of state so every render thread can own one.
+// Seeding from (pixel, sample, frame) makes each sample's random stream
+// independent of which thread renders it and in what order.
+class sampler {
+public:
+	sampler() { reseed(0); }
+	explicit sampler(uint64_t seed) { reseed(seed); }
+	sampler(uint64_t pixel, uint64_t sample_index, uint64_t frame) { reseed(pixel, sample_index, frame); }
+
+	void reseed(uint64_t seed) {
+		for (auto& word : s)
+			word = splitmix64(seed);
+	}
+
+	void reseed(uint64_t pixel, uint64_t sample_index, uint64_t frame) {
+		reseed(mix(mix(mix(frame) ^ pixel) ^ sample_index));
+	}
+
+	uint64_t next() {
+		const uint64_t result = s[0] + s[3];
+		const uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+
+	// Uniform in [0, 1), built from the top 53 bits
+	double next_double() {
+		return (next() >> 11) * 0x1.0p-53;
+	}
+
+	double next_double(double min, double max) {
+		return min + (max - min) * next_double();
+	}
+
+private:
+	uint64_t s[4];
+
+	static uint64_t rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+	static uint64_t mix(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	static uint64_t splitmix64(uint64_t& state) {
+		return mix(state += 0x9e3779b97f4a7c15ull);
+	}
+};
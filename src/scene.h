@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "material.h"
+#include "visible_collection.h"
+
+// Owns every material of a scene. Primitives and hit records only keep the
+// returned pointers, so shading a hit never touches a reference count.
+class material_table {
+public:
+	template <typename T, typename... Args>
+	const material* add(Args&&... args) {
+		owned.push_back(std::make_unique<T>(std::forward<Args>(args)...));
+		return owned.back().get();
+	}
+
+	size_t size() const { return owned.size(); }
+
+private:
+	std::vector<std::unique_ptr<material>> owned;
+};
+
+// The materials must outlive anything built from the objects, such as a BVH
+struct scene {
+	material_table materials;
+	visible_collection objects;
+	visible_collection lights; // Filled by find_lights()
+
+	// Collects the top-level primitives with an emissive material that can be sampled directly
+	void find_lights();
+};
+
+void scene::find_lights() {
+	lights.clear();
+	for (const auto& object : objects) {
+		auto emitter = object->light_material();
+		if (emitter && emitter->is_emissive()) lights.add(object);
+	}
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "random_number.h"
+#include "visible_collection.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "material.h"
+#include "texture.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "aarect.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "scene.h"
+
+scene random_scene() {
+	scene world;
+	auto& materials = world.materials;
+
+	auto checker = std::make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+	world.objects.add(std::make_shared<sphere>(vec3(0, -1000, 0), 1000, materials.add<lambertian>(checker)));
+
+	for (int a = -11; a < 11; a++) {
+		for (int b = -11; b < 11; b++) {
+			auto choose_mat = random_double();
+			vec3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+			if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
+				const material* sphere_material;
+
+				if (choose_mat < 0.8) {
+					// diffuse
+					auto albedo = color::random() * color::random();
+					sphere_material = materials.add<lambertian>(albedo);
+					auto center2 = center + vec3(0, random_double(0, .5), 0);
+					world.objects.add(std::make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
+				}
+				else if (choose_mat < 0.95) {
+					// metal
+					auto albedo = color::random(0.5, 1);
+					auto fuzz = random_double(0, 0.5);
+					sphere_material = materials.add<metal>(albedo, fuzz);
+					world.objects.add(std::make_shared<sphere>(center, 0.2, sphere_material));
+				}
+				else {
+					// glass
+					sphere_material = materials.add<dielectric>(1.5);
+					world.objects.add(std::make_shared<sphere>(center, 0.2, sphere_material));
+				}
+			}
+		}
+	}
+
+	auto material1 = materials.add<dielectric>(1.5);
+	world.objects.add(std::make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
+
+	auto material2 = materials.add<lambertian>(color(0.4, 0.2, 0.1));
+	world.objects.add(std::make_shared<sphere>(vec3(-4, 1, 0), 1.0, material2));
+
+	auto material3 = materials.add<metal>(color(0.7, 0.6, 0.5), 0.0);
+	world.objects.add(std::make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+
+	return world;
+}
+
+scene two_spheres() {
+	scene world;
+	auto& materials = world.materials;
+	auto& objects = world.objects;
+	auto checker = materials.add<lambertian>(
+		std::make_shared<checker_texture>(
+			color(0.2, 0.3, 0.1),
+			color(0.9, 0.9, 0.9)
+	));
+	objects.add(std::make_shared<sphere>(vec3{ 0, -10, 0 }, 10, checker));
+	objects.add(std::make_shared<sphere>(vec3{ 0, 10, 0 }, 10, checker));
+	return world;
+}
+
+scene two_perlin_spheres() {
+	scene world;
+	auto& materials = world.materials;
+	auto& objects = world.objects;
+	auto pertext = materials.add<lambertian>(std::make_shared<noise_texture>(4));
+	objects.add(std::make_shared<sphere>(vec3{ 0, -1000, 0 }, 1000, pertext));
+	objects.add(std::make_shared<sphere>(vec3{ 0, 2, 0 }, 2, pertext));
+	return world;
+}
+
+scene earth() {
+	scene world;
+	auto earth_texture = std::make_shared<image_texture>("Blue_Marble_2002.png");
+	auto earth_surface = world.materials.add<lambertian>(earth_texture);
+	world.objects.add(std::make_shared<sphere>(vec3(0, 0, 0), 2, earth_surface));
+	return world;
+}
+
+scene simple_light() {
+	scene world;
+	auto& materials = world.materials;
+	auto& objects = world.objects;
+	auto pertext = materials.add<lambertian>(std::make_shared<noise_texture>(4));
+	objects.add(std::make_shared<sphere>(vec3{ 0, -1000, 0 }, 1000, pertext));
+	objects.add(std::make_shared<sphere>(vec3{ 0, 2, 0 }, 2, pertext));
+	auto difflight = materials.add<diffuse_light>(color(4, 4, 4));
+	objects.add(std::make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+	auto nolight = materials.add<diffuse_light>(color(0, 0, 0));
+	objects.add(std::make_shared<sphere>(vec3{ 0, 0, 0 }, -10000, nolight));
+	return world;
+}
+
+scene cornell_box() {
+	scene world;
+	auto& materials = world.materials;
+	auto& objects = world.objects;
+	auto red = materials.add<lambertian>(color(.65, .05, .05));
+	auto white = materials.add<lambertian>(color(.73, .73, .73));
+	auto green = materials.add<lambertian>(color(.12, .45, .15));
+	auto light = materials.add<diffuse_light>(color(15, 15, 15));
+	auto background = materials.add<diffuse_light>(color(0, 0, 0));
+	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+
+	objects.add(std::make_shared<xz_rect>(213, 343, 227, 332, 554, light));
+	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+
+	objects.add(std::make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+	objects.add(std::make_shared<sphere>(vec3{ 277, 277, 277 }, -2216, background));
+
+	std::shared_ptr<visible> box1 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 330, 165 }, white);
+	box1 = std::make_shared<rotate_y>(box1, 15);
+	box1 = std::make_shared<translate>(box1, vec3{ 265, 0, 295 });
+	std::shared_ptr<visible> box2 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 165, 165 }, white);
+	box2 = std::make_shared<rotate_y>(box2, -18);
+	box2 = std::make_shared<translate>(box2, vec3{ 130, 0, 65 });
+
+	objects.add(box1);
+	objects.add(box2);
+	return world;
+}
+
+scene cornell_smoke() {
+	scene world;
+	auto& materials = world.materials;
+	auto& objects = world.objects;
+	auto red = materials.add<lambertian>(color(.65, .05, .05));
+	auto white = materials.add<lambertian>(color(.73, .73, .73));
+	auto green = materials.add<lambertian>(color(.12, .45, .15));
+	auto light = materials.add<diffuse_light>(color(7, 7, 7));
+	auto background = materials.add<diffuse_light>(color(0, 0, 0));
+	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+
+	objects.add(std::make_shared<xz_rect>(113, 443, 127, 432, 554, light));
+	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+
+	objects.add(std::make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+	objects.add(std::make_shared<sphere>(vec3{ 277, 277, 277 }, -2216, background));
+
+	std::shared_ptr<visible> box1 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 330, 165 }, white);
+	box1 = std::make_shared<rotate_y>(box1, 15);
+	box1 = std::make_shared<translate>(box1, vec3{ 265, 0, 295 });
+	std::shared_ptr<visible> box2 = std::make_shared<box>(vec3{ 0, 0, 0 }, vec3{ 165, 165, 165 }, white);
+	box2 = std::make_shared<rotate_y>(box2, -18);
+	box2 = std::make_shared<translate>(box2, vec3{ 130, 0, 65 });
+
+	objects.add(std::make_shared<constant_medium>(box1, 0.01, materials.add<isotropic>(color{ 0, 0, 0 })));
+	objects.add(std::make_shared<constant_medium>(box2, 0.01, materials.add<isotropic>(color{ 1, 1, 1 })));
+	return world;
+}
+
+scene final_scene() {
+	scene world;
+	auto& materials = world.materials;
+	auto& objects = world.objects;
+
+	visible_collection boxes1;
+	auto ground = materials.add<lambertian>(color{ 0.48, 0.83, 0.53 });
+
+	const int boxes_per_side = 20;
+	for (int i = 0; i < boxes_per_side; ++i)
+		for (int j = 0; j < boxes_per_side; ++j) {
+			auto w = 100.0;
+			auto x0 = -1000.0 + i * w;
+			auto z0 = -1000.0 + j * w;
+			auto y0 = 0.0;
+			auto x1 = x0 + w;
+			auto z1 = z0 + w;
+			auto y1 = random_double(1, 101);
+			boxes1.add(std::make_shared<box>(vec3{ x0, y0, z0 }, vec3{ x1, y1, z1 }, ground));
+		}
+
+	objects.add(std::make_shared<bvh_node>(boxes1, 0, 1));
+
+	auto light = materials.add<diffuse_light>(color{ 7, 7, 7 });
+	objects.add(std::make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+
+	auto center1 = vec3(400, 400, 200);
+	auto center2 = center1 + vec3(30, 0, 0);
+	auto moving_sphere_material = materials.add<lambertian>(color{ 0.7, 0.3, 0.1 });
+	objects.add(std::make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+
+	objects.add(std::make_shared<sphere>(vec3{ 260, 150, 45 }, 50, materials.add<dielectric>(1.5)));
+	objects.add(std::make_shared<sphere>(vec3{ 0, 150, 145 }, 50, materials.add<metal>(color{ 0.8, 0.8, 0.9 }, 1.0)));
+
+	auto boundary = std::make_shared<sphere>(vec3{ 360, 150, 145 }, 70, materials.add<dielectric>(1.5));
+	objects.add(boundary);
+	objects.add(std::make_shared<constant_medium>(boundary, 0.2, materials.add<isotropic>(color{ 0.2, 0.4, 0.9 })));
+
+	objects.add(std::make_shared<constant_medium>(
+		std::make_shared<sphere>(vec3{ 0, 0, 0 }, 5000, nullptr), 0.0001, materials.add<isotropic>(color{ 1, 1, 1 })));
+
+	auto emat = materials.add<lambertian>(std::make_shared<image_texture>("Blue_Marble_2002.png"));
+	objects.add(std::make_shared<sphere>(vec3{ 400, 200, 400 }, 100, emat));
+	
+	auto permat = materials.add<lambertian>(std::make_shared<noise_texture>(0.1));
+	objects.add(std::make_shared<sphere>(vec3{ 220, 280, 300 }, 80, permat));
+
+	visible_collection boxes2;
+	auto white = materials.add<lambertian>(color{ .73, .73, .73 });
+	int ns = 1000;
+	for (int j = 0; j < ns; j++)
+		boxes2.add(std::make_shared<sphere>(vec3::random(0, 165), 10, white));
+	objects.add(std::make_shared<translate>(
+		std::make_shared<rotate_y>(
+			std::make_shared<linear_bvh>(bvh_node(boxes2, 0.0, 1.0)),
+			15
+		),
+		vec3{ -100, 270, 395 }
+	));
+
+	return world;
+}
+
+// A scene function together with the camera it was set up for
+struct scene_preset {
+	std::string name;
+	std::function<scene()> build;
+	vec3 lookfrom;
+	vec3 lookat;
+	double vfov;
+	double aperture = 0.0;
+};
+
+const std::vector<scene_preset>& scene_presets() {
+	static const std::vector<scene_preset> presets = {
+		{ "random_scene", random_scene, vec3(13, 2, 3), vec3(0, 0, 0), 20.0, 0.1 },
+		{ "two_spheres", two_spheres, vec3(13, 2, 3), vec3(0, 0, 0), 20.0 },
+		{ "two_perlin_spheres", two_perlin_spheres, vec3(13, 2, 3), vec3(0, 0, 0), 20.0 },
+		{ "earth", earth, vec3(13, 2, 3), vec3(0, 0, 0), 20.0 },
+		{ "simple_light", simple_light, vec3(26, 3, 6), vec3(0, 2, 0), 20.0 },
+		{ "cornell_box", cornell_box, vec3(278, 278, -800), vec3(278, 278, 0), 40.0 },
+		{ "cornell_smoke", cornell_smoke, vec3(278, 278, -800), vec3(278, 278, 0), 40.0 },
+		{ "final_scene", final_scene, vec3(478, 278, -600), vec3(278, 278, 0), 40.0 },
+	};
+	return presets;
+}
+
+const scene_preset* find_scene_preset(const std::string& name) {
+	for (const auto& preset : scene_presets())
+		if (preset.name == name) return &preset;
+	return nullptr;
+}
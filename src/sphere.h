@@ -1,18 +1,31 @@
 #pragma once
 
+#include <cassert>
+#include <cmath>
+#include <utility>
+
+#include "onb.h"
 #include "visible.h"
 
 class sphere : public visible {
 public:
 	sphere() : r(0) {};
-	sphere(vec3 center, double radius, std::shared_ptr<material> material)
+	sphere(vec3 center, double radius, const material* material)
 		: c(center), r(radius), m(material) {};
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	void intersect_packet(ray_packet& packet, int first, int last, const uint8_t* active) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override;
+	hit surface(const ray& r, const intersection& isect, int level) const override;
+	primitive_type type() const override { return primitive_type::sphere; }
+
+	// Sampled by the solid angle it subtends, inside-out spheres are never lights
+	const material* light_material() const override { return this->r > 0 ? m : nullptr; }
+	double pdf_value(const vec3& origin, const vec3& direction) const override;
+	vec3 random(const vec3& origin, sampler& rng) const override;
 
 	static std::pair<double, double> get_sphere_uv(const vec3& p) {
-		assert(std::fabs(p.length_squared() - 1.0) < std::numeric_limits<T>::min());
+		assert(std::fabs(p.length_squared() - 1.0) < 1e-6);
 		auto theta = acos(-p.y());
 		auto phi = atan2(-p.z(), p.x()) + pi;
 		return {
@@ -24,28 +37,73 @@ public:
 private:
 	vec3 c;
 	double r;
-	std::shared_ptr<material> m;
+	const material* m;
 };
 
-std::optional<hit> sphere::hit_check(const ray& r, double t_min, double t_max) const {
+bool sphere::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
 	vec3 o_c = r.origin() - this->c;
 	double a = r.direction().length_squared(); // <v, v> = |v|^2
 	double hb = dot(r.direction(), o_c);
 	double c = o_c.length_squared() - this->r * this->r;
 	double d = hb * hb - a * c;
 	if (d < 0) { // at^2 + bt + c = 0 has no solutions
-		return std::nullopt;
+		return false;
 	}
 	
 	double d_sqrt = std::sqrt(d);
 	double root = (-hb - d_sqrt) / a;
 	if (root < t_min || root > t_max) {
 		root = (-hb + d_sqrt) / a;
-		if (root < t_min || root > t_max) return std::nullopt;
+		if (root < t_min || root > t_max) return false;
 	}
-	
+
+	isect.record(root, this);
+	return true;
+}
+
+// The same arithmetic as intersect() on the active rays of the packet, two at a time with
+// SSE2, then a pass to record the hits
+void sphere::intersect_packet(ray_packet& packet, int first, int last, const uint8_t* active) const {
+	double roots[ray_packet::max_size];
+	int n = first;
+#ifdef RAYTRACER_X86
+	const __m128d t_min = _mm_set1_pd(packet.t_min), radius_squared = _mm_set1_pd(this->r * this->r);
+	for (; n + 2 <= last; n += 2) {
+		__m128d o[3], d[3];
+		for (int a = 0; a < 3; ++a) {
+			o[a] = _mm_sub_pd(_mm_loadu_pd(&packet.origin[a][n]), _mm_set1_pd(c[a]));
+			d[a] = _mm_loadu_pd(&packet.direction[a][n]);
+		}
+		auto dot = [](const __m128d* x, const __m128d* y) {
+			return _mm_add_pd(_mm_add_pd(_mm_mul_pd(x[0], y[0]), _mm_mul_pd(x[1], y[1])), _mm_mul_pd(x[2], y[2]));
+		};
+		__m128d a = dot(d, d);
+		__m128d hb = dot(d, o);
+		__m128d k = _mm_sub_pd(dot(o, o), radius_squared);
+		__m128d disc = _mm_sub_pd(_mm_mul_pd(hb, hb), _mm_mul_pd(a, k));
+		__m128d d_sqrt = _mm_sqrt_pd(_mm_max_pd(disc, _mm_setzero_pd()));
+		__m128d minus_hb = _mm_sub_pd(_mm_setzero_pd(), hb);
+		__m128d near = _mm_div_pd(_mm_sub_pd(minus_hb, d_sqrt), a);
+		__m128d far = _mm_div_pd(_mm_add_pd(minus_hb, d_sqrt), a);
+		__m128d t_max = _mm_loadu_pd(&packet.t_max[n]);
+		__m128d near_ok = _mm_and_pd(_mm_cmpge_pd(near, t_min), _mm_cmple_pd(near, t_max));
+		__m128d far_ok = _mm_and_pd(_mm_cmpge_pd(far, t_min), _mm_cmple_pd(far, t_max));
+		__m128d root = _mm_or_pd(_mm_and_pd(near_ok, near), _mm_andnot_pd(near_ok, far));
+		__m128d hit = _mm_and_pd(_mm_cmpge_pd(disc, _mm_setzero_pd()), _mm_or_pd(near_ok, far_ok));
+		_mm_storeu_pd(&roots[n], _mm_or_pd(_mm_and_pd(hit, root), _mm_andnot_pd(hit, _mm_set1_pd(infinity))));
+	}
+#endif
+	for (; n < last; ++n) {
+		intersection isect;
+		roots[n] = intersect(packet.rays[n], packet.t_min, packet.t_max[n], isect) ? isect.t : infinity;
+	}
+	for (n = first; n < last; ++n)
+		if (active[n] && roots[n] < infinity) packet.record(n, roots[n], this);
+}
+
+hit sphere::surface(const ray& r, const intersection& isect, int level) const {
 	hit rec;
-	rec.t = root;
+	rec.t = isect.t;
 	rec.point = r.at(rec.t);
 	vec3 outward_normal = (rec.point - this->c) / this->r;
 	rec.set_face_normal(r, outward_normal);
@@ -55,6 +113,31 @@ std::optional<hit> sphere::hit_check(const ray& r, double t_min, double t_max) c
 	return rec;
 }
 
+double sphere::pdf_value(const vec3& origin, const vec3& direction) const {
+	intersection isect;
+	if (!intersect(ray(origin, direction), 0.001, infinity, isect)) return 0;
+
+	auto ratio = this->r * this->r / (this->c - origin).length_squared();
+	if (ratio >= 1) return 0; // Inside the sphere, not sampled
+	auto cos_theta_max = std::sqrt(1 - ratio);
+	return 1 / (2 * pi * (1 - cos_theta_max));
+}
+
+vec3 sphere::random(const vec3& origin, sampler& rng) const {
+	vec3 direction = this->c - origin;
+	auto ratio = this->r * this->r / direction.length_squared();
+	if (ratio >= 1) return direction;
+
+	// Uniform over the cone of directions that hit the sphere
+	auto r1 = rng.next_double();
+	auto r2 = rng.next_double();
+	auto cos_theta_max = std::sqrt(1 - ratio);
+	auto z = 1 + r2 * (cos_theta_max - 1);
+	auto phi = 2 * pi * r1;
+	auto sin_theta = std::sqrt(1 - z * z);
+	return onb(direction).local(vec3(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, z));
+}
+
 std::optional<aabb> sphere::bounding_box(double time0, double time1) const {
 	auto radius = fabs(this->r);
 	return aabb(
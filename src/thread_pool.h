@@ -0,0 +1,266 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+size_t physical_core_count() {
+	size_t count = 0;
+#ifdef _WIN32
+	DWORD length = 0;
+	GetLogicalProcessorInformation(nullptr, &length);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (!info.empty() && GetLogicalProcessorInformation(info.data(), &length))
+		for (const auto& entry : info)
+			if (entry.Relationship == RelationProcessorCore) ++count;
+#else
+	// Each (package, core) pair is one physical core, hyperthreads share it
+	std::set<std::pair<int, int>> cores;
+	for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu) {
+		const auto topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		std::ifstream package_file(topology + "physical_package_id");
+		std::ifstream core_file(topology + "core_id");
+		int package = 0, core = 0;
+		if (!(package_file >> package) || !(core_file >> core)) break;
+		cores.emplace(package, core);
+	}
+	count = cores.size();
+#endif
+	if (count == 0) count = std::thread::hardware_concurrency();
+	return count > 0 ? count : 1;
+}
+
+struct worker_stats {
+	double busy_seconds = 0;
+	double idle_seconds = 0;
+	size_t tasks_run = 0;
+	size_t tasks_stolen = 0;
+};
+
+class thread_pool;
+
+// Counts the outstanding tasks of one batch of work so it can be waited on
+class task_group {
+public:
+	task_group() {}
+	task_group(const task_group&) = delete;
+	task_group& operator=(const task_group&) = delete;
+
+private:
+	friend class thread_pool;
+	std::atomic<size_t> pending{ 0 };
+};
+
+// Fixed-size pool where every worker owns a deque of tasks: the owner pops the
+// newest task from the back, idle workers steal the oldest task from the front
+// of someone else's deque.
+class thread_pool {
+public:
+	explicit thread_pool(size_t num_workers = physical_core_count());
+	~thread_pool();
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	size_t size() const { return workers.size(); }
+
+	// Queues on the calling worker's own deque, or on worker `hint` when called from outside the pool
+	void submit(task_group& group, std::function<void()> task, size_t hint = 0);
+	// Workers keep running queued tasks while they wait, so tasks may wait on nested groups
+	void wait(task_group& group);
+
+	std::vector<worker_stats> stats() const;
+	void reset_stats();
+
+	// Index of the calling worker in its pool, or -1 outside of any pool
+	static int current_worker();
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct task {
+		std::function<void()> work;
+		task_group* group = nullptr;
+	};
+
+	struct worker {
+		mutable std::mutex mutex;
+		std::deque<task> tasks;
+		worker_stats stats;
+		std::thread thread;
+	};
+
+	bool try_pop(size_t index, task& t);
+	bool try_steal(size_t index, task& t);
+	void execute(size_t index, task& t, bool stolen);
+	void run(size_t index);
+
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<size_t> queued{ 0 };
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	bool stopping = false;
+
+	static thread_local thread_pool* current_pool;
+	static thread_local int current_index;
+	static thread_local int nesting;
+};
+
+thread_local thread_pool* thread_pool::current_pool = nullptr;
+thread_local int thread_pool::current_index = -1;
+thread_local int thread_pool::nesting = 0;
+
+thread_pool::thread_pool(size_t num_workers) {
+	if (num_workers == 0) num_workers = 1;
+	for (size_t i = 0; i < num_workers; ++i)
+		workers.push_back(std::make_unique<worker>());
+	for (size_t i = 0; i < num_workers; ++i)
+		workers[i]->thread = std::thread(&thread_pool::run, this, i);
+}
+
+thread_pool::~thread_pool() {
+	{
+		std::lock_guard lock(sleep_mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& w : workers)
+		w->thread.join();
+}
+
+int thread_pool::current_worker() {
+	return current_index;
+}
+
+void thread_pool::submit(task_group& group, std::function<void()> work, size_t hint) {
+	group.pending.fetch_add(1, std::memory_order_relaxed);
+	size_t target = current_pool == this ? current_index : hint % workers.size();
+	{
+		// Counted before it becomes visible so a racing pop can never underflow
+		std::lock_guard lock(sleep_mutex);
+		queued.fetch_add(1, std::memory_order_release);
+	}
+	{
+		std::lock_guard lock(workers[target]->mutex);
+		workers[target]->tasks.push_back(task{ std::move(work), &group });
+	}
+	wake.notify_one();
+}
+
+void thread_pool::wait(task_group& group) {
+	if (current_pool == this) {
+		while (group.pending.load(std::memory_order_acquire) > 0) {
+			task t;
+			if (try_pop(current_index, t))
+				execute(current_index, t, false);
+			else if (try_steal(current_index, t))
+				execute(current_index, t, true);
+			else
+				std::this_thread::yield();
+		}
+		return;
+	}
+	std::unique_lock lock(sleep_mutex);
+	finished.wait(lock, [&] { return group.pending.load(std::memory_order_acquire) == 0; });
+}
+
+std::vector<worker_stats> thread_pool::stats() const {
+	std::vector<worker_stats> result;
+	for (const auto& w : workers) {
+		std::lock_guard lock(w->mutex);
+		result.push_back(w->stats);
+	}
+	return result;
+}
+
+void thread_pool::reset_stats() {
+	for (auto& w : workers) {
+		std::lock_guard lock(w->mutex);
+		w->stats = worker_stats{};
+	}
+}
+
+bool thread_pool::try_pop(size_t index, task& t) {
+	auto& w = *workers[index];
+	std::lock_guard lock(w.mutex);
+	if (w.tasks.empty()) return false;
+	t = std::move(w.tasks.back());
+	w.tasks.pop_back();
+	queued.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool thread_pool::try_steal(size_t index, task& t) {
+	for (size_t offset = 1; offset < workers.size(); ++offset) {
+		auto& victim = *workers[(index + offset) % workers.size()];
+		std::lock_guard lock(victim.mutex);
+		if (victim.tasks.empty()) continue;
+		t = std::move(victim.tasks.front());
+		victim.tasks.pop_front();
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void thread_pool::execute(size_t index, task& t, bool stolen) {
+	auto start = clock::now();
+	++nesting;
+	t.work();
+	--nesting;
+	auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	{
+		auto& w = *workers[index];
+		std::lock_guard lock(w.mutex);
+		// Tasks run while waiting inside another task are already part of its busy time
+		if (nesting == 0) w.stats.busy_seconds += elapsed;
+		++w.stats.tasks_run;
+		if (stolen) ++w.stats.tasks_stolen;
+	}
+	if (t.group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		std::lock_guard lock(sleep_mutex);
+		finished.notify_all();
+	}
+}
+
+void thread_pool::run(size_t index) {
+	current_pool = this;
+	current_index = static_cast<int>(index);
+	for (;;) {
+		task t;
+		if (try_pop(index, t)) {
+			execute(index, t, false);
+			continue;
+		}
+		if (try_steal(index, t)) {
+			execute(index, t, true);
+			continue;
+		}
+
+		auto idle_start = clock::now();
+		{
+			std::unique_lock lock(sleep_mutex);
+			wake.wait(lock, [&] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+			if (stopping && queued.load(std::memory_order_acquire) == 0) return;
+		}
+		auto idle = std::chrono::duration<double>(clock::now() - idle_start).count();
+		std::lock_guard lock(workers[index]->mutex);
+		workers[index]->stats.idle_seconds += idle;
+	}
+}
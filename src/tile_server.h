@@ -0,0 +1,460 @@
+#pragma once
+
+// Distributed rendering over a socket. A coordinator owns the frame and hands its tiles
+// out to any number of worker processes, which render them on their own thread pool and
+// send back the sums and counts. Tiles held by a worker that disconnects go back in the
+// queue for the others. Addresses are unix:<path> for a Unix domain socket or
+// <host>:<port> for TCP, where an empty host means localhost.
+//
+// Every message is a little-endian type and payload size followed by the payload:
+// worker hello (name), coordinator job (scene, settings and how to trace), then worker requests
+// (tile count) answered by tiles (ids) or done, and a result (id, rays, pixels) per tile.
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "renderer.h"
+#include "thread_pool.h"
+#include "byte_stream.h"
+#include "checkpoint.h"
+
+namespace tile_server_detail {
+
+	enum class message : uint32_t { hello = 1, job, request, tiles, result, done };
+
+	constexpr int tile_size = 16;
+	constexpr uint32_t max_payload = uint32_t(1) << 30;
+
+	// A listening or connected socket for `address`, -1 with an error printed on failure
+	inline int open_socket(const std::string& address, bool listening) {
+		auto fail = [&](int fd, const char* what) {
+			std::cerr << "ERROR: Could not " << what << ' ' << address << ": " << std::strerror(errno) << ".\n";
+			if (fd >= 0) close(fd);
+			return -1;
+		};
+
+		if (address.rfind("unix:", 0) == 0) {
+			auto path = address.substr(5);
+			sockaddr_un addr{};
+			if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+				std::cerr << "ERROR: Invalid socket path in " << address << ".\n";
+				return -1;
+			}
+			addr.sun_family = AF_UNIX;
+			std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+			int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0) return fail(fd, "open a socket for");
+			if (listening) {
+				unlink(path.c_str()); // Left behind by an earlier coordinator
+				if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) return fail(fd, "listen on");
+			}
+			else if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+				return fail(fd, "connect to");
+			return fd;
+		}
+
+		auto colon = address.rfind(':');
+		if (colon == std::string::npos) {
+			std::cerr << "ERROR: Invalid address " << address << ", expected unix:<path> or <host>:<port>.\n";
+			return -1;
+		}
+		auto host = colon > 0 ? address.substr(0, colon) : std::string("localhost"); // Resolved alike by both ends
+		auto port = address.substr(colon + 1);
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* found = nullptr;
+		if (int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &found)) {
+			std::cerr << "ERROR: Could not resolve " << address << ": " << gai_strerror(error) << ".\n";
+			return -1;
+		}
+		int fd = -1;
+		for (auto* candidate = found; candidate; candidate = candidate->ai_next) {
+			fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+			if (fd < 0) continue;
+			int on = 1;
+			if (listening) {
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+				if (bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break;
+			}
+			else if (connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+				// Requests are small and wait for their answer
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				break;
+			}
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(found);
+		if (fd < 0) return fail(fd, listening ? "listen on" : "connect to");
+		return fd;
+	}
+
+	inline bool send_message(int fd, message type, const std::string& payload) {
+		std::string data;
+		data.reserve(8 + payload.size());
+		put_u32(data, static_cast<uint32_t>(type));
+		put_u32(data, static_cast<uint32_t>(payload.size()));
+		data += payload;
+		for (size_t sent = 0; sent < data.size();) {
+			auto written = write(fd, data.data() + sent, data.size() - sent);
+			if (written < 0 && errno == EINTR) continue;
+			if (written <= 0) return false;
+			sent += size_t(written);
+		}
+		return true;
+	}
+
+	inline bool receive_all(int fd, char* data, size_t size) {
+		for (size_t received = 0; received < size;) {
+			auto count = read(fd, data + received, size - received);
+			if (count < 0 && errno == EINTR) continue;
+			if (count <= 0) return false;
+			received += size_t(count);
+		}
+		return true;
+	}
+
+	// False once the connection is closed or broken
+	inline bool receive_message(int fd, message& type, std::string& payload) {
+		std::string header(8, '\0');
+		if (!receive_all(fd, header.data(), header.size())) return false;
+		byte_reader in(header);
+		type = static_cast<message>(in.u32());
+		auto size = in.u32();
+		if (size > max_payload) return false;
+		payload.resize(size);
+		return receive_all(fd, payload.data(), size);
+	}
+
+}
+
+// What one worker connection contributed, for sizing the fleet
+struct worker_report {
+	std::string name;
+	size_t tiles = 0;
+	uint64_t samples = 0;
+	uint64_t rays = 0;
+	double seconds = 0; // Connected
+	bool lost = false; // Disconnected with tiles unfinished
+};
+
+// Renders the frame of `settings` into `buffer`, a full tile at a time, with the workers
+// that connect to `address`. Returns once every tile is in, or nothing when the socket
+// cannot be opened.
+std::optional<render_stats> serve_tiles(const std::string& address, const std::string& scene, const render_settings& settings, accumulation_buffer& buffer, std::vector<worker_report>& workers) {
+	using namespace tile_server_detail;
+	std::signal(SIGPIPE, SIG_IGN); // A worker dying mid-send shows up as a failed write
+	int listener = open_socket(address, true);
+	if (listener < 0) return std::nullopt;
+
+	const auto tiles = make_tiles(settings.width, settings.height, tile_size);
+	std::string job;
+	put_frame(job, scene, settings);
+	put_tracing(job, settings);
+
+	struct connection {
+		int fd;
+		std::mutex send_mutex;
+		bool done_sent = false;
+		std::thread thread;
+
+		bool send(message type, const std::string& payload) {
+			std::lock_guard lock(send_mutex);
+			if (done_sent) return false;
+			done_sent = type == message::done;
+			return send_message(fd, type, payload);
+		}
+	};
+
+	// Guards everything below, tiles are owned by the connection they were handed to
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<uint32_t> pending;
+	for (uint32_t id = 0; id < tiles.size(); ++id)
+		pending.push_back(id);
+	std::vector<int> owner(tiles.size(), -1);
+	size_t remaining = tiles.size();
+	size_t connected = 0;
+	bool finished = false;
+	std::vector<std::unique_ptr<connection>> connections;
+	workers.clear();
+	render_stats stats;
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [](std::chrono::steady_clock::time_point since) { return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count(); };
+
+	auto serve = [&](connection* conn, int w) {
+		auto connected_at = std::chrono::steady_clock::now();
+		message type;
+		std::string payload;
+		bool ok = receive_message(conn->fd, type, payload) && type == message::hello;
+		if (ok) {
+			byte_reader in(payload);
+			std::lock_guard lock(mutex);
+			workers[w].name = in.string();
+		}
+		ok = ok && conn->send(message::job, job);
+
+		while (ok && receive_message(conn->fd, type, payload)) {
+			byte_reader in(payload);
+			if (type == message::request) {
+				auto wanted = std::max<uint32_t>(in.u32(), 1);
+				std::string reply;
+				{
+					std::unique_lock lock(mutex);
+					changed.wait(lock, [&] { return !pending.empty() || remaining == 0; });
+					if (remaining == 0) break;
+					auto count = std::min<size_t>(wanted, pending.size());
+					put_u32(reply, static_cast<uint32_t>(count));
+					for (size_t k = 0; k < count; ++k) {
+						auto id = pending.front();
+						pending.pop_front();
+						owner[id] = w;
+						put_u32(reply, id);
+					}
+				}
+				ok = conn->send(message::tiles, reply);
+			}
+			else if (type == message::result) {
+				auto id = in.u32();
+				auto rays = in.u64();
+				std::lock_guard lock(mutex);
+				if (!in.ok() || id >= tiles.size() || owner[id] != w) break;
+				// Results overwrite, so a tile that fails to parse is simply rendered again
+				const auto& t = tiles[id];
+				uint64_t samples = 0;
+				for (int y = t.y0; y < t.y1; ++y)
+					for (int x = t.x0; x < t.x1; ++x) {
+						size_t n = size_t(y) * buffer.width + x;
+						buffer.counts[n] = in.u32();
+						for (int c = 0; c < 3; ++c)
+							buffer.sums[n][c] = in.f64();
+						samples += buffer.counts[n];
+					}
+				if (!in.ok() || !in.at_end()) break;
+				owner[id] = -1;
+				if (--remaining == 0) changed.notify_all();
+				stats.rays += rays;
+				stats.samples += samples;
+				++workers[w].tiles;
+				workers[w].rays += rays;
+				workers[w].samples += samples;
+			}
+			else
+				break;
+		}
+
+		// Whatever it still holds goes to the others
+		std::lock_guard lock(mutex);
+		for (uint32_t id = 0; id < tiles.size(); ++id)
+			if (owner[id] == w) {
+				owner[id] = -1;
+				pending.push_front(id);
+				workers[w].lost = true;
+			}
+		workers[w].seconds = elapsed(connected_at);
+		--connected;
+		changed.notify_all();
+	};
+
+	std::thread acceptor([&] {
+		while (true) {
+			pollfd ready{ listener, POLLIN, 0 };
+			int events = poll(&ready, 1, 100);
+			std::lock_guard lock(mutex);
+			if (finished) return;
+			if (events <= 0) continue;
+			int fd = accept(listener, nullptr, nullptr);
+			if (fd < 0) continue;
+			auto c = std::make_unique<connection>();
+			c->fd = fd;
+			workers.emplace_back();
+			++connected;
+			c->thread = std::thread(serve, c.get(), int(workers.size() - 1));
+			connections.push_back(std::move(c));
+		}
+	});
+
+	{
+		std::unique_lock lock(mutex);
+		while (remaining > 0) {
+			changed.wait_for(lock, std::chrono::milliseconds(500));
+			if (settings.progress)
+				std::cerr << "\rTiles remaining: " << remaining << " of " << tiles.size() << ", " << connected << " workers  " << std::flush;
+		}
+		finished = true;
+	}
+	if (settings.progress) std::cerr << "\n";
+	acceptor.join();
+	close(listener);
+	if (address.rfind("unix:", 0) == 0) unlink(address.substr(5).c_str());
+
+	// Workers still connected learn the frame is done even if they are between requests
+	for (auto& c : connections) {
+		c->send(message::done, {});
+		shutdown(c->fd, SHUT_RDWR);
+		c->thread.join();
+		close(c->fd);
+	}
+
+	stats.passes = 1;
+	stats.seconds = elapsed(start);
+	return stats;
+}
+
+// The worker side of serve_tiles(): connects, receives the job, then renders the tiles
+// it is handed until the coordinator has all of them.
+class tile_worker {
+public:
+	tile_worker() {}
+	~tile_worker() { if (fd >= 0) close(fd); }
+
+	tile_worker(const tile_worker&) = delete;
+	tile_worker& operator=(const tile_worker&) = delete;
+
+	// False with an error printed when there is no coordinator or it sent no job
+	bool connect(const std::string& address);
+
+	const std::string& scene() const { return job_scene; }
+	const render_settings& settings() const { return job_settings; }
+
+	// Renders batches of tiles with render_one() on the pool, each from an empty buffer.
+	// `interrupted` is set when the coordinator went away before the frame was done.
+	render_stats run(thread_pool& pool, const std::function<tile_result(const tile&, accumulation_buffer&)>& render_one);
+
+private:
+	int fd = -1;
+	std::string job_scene;
+	render_settings job_settings;
+};
+
+bool tile_worker::connect(const std::string& address) {
+	using namespace tile_server_detail;
+	std::signal(SIGPIPE, SIG_IGN);
+	fd = open_socket(address, false);
+	if (fd < 0) return false;
+
+	char host[256] = {};
+	gethostname(host, sizeof(host) - 1);
+	std::string hello;
+	put_string(hello, std::string(host) + ":" + std::to_string(getpid()));
+	message type;
+	std::string payload;
+	if (!send_message(fd, message::hello, hello) || !receive_message(fd, type, payload) || type != message::job) {
+		std::cerr << "ERROR: No job from the coordinator at " << address << ".\n";
+		return false;
+	}
+	byte_reader in(payload);
+	if (!read_frame(in, job_scene, job_settings) || !read_tracing(in, job_settings)) {
+		std::cerr << "ERROR: Invalid job from the coordinator at " << address << ".\n";
+		return false;
+	}
+	return true;
+}
+
+render_stats tile_worker::run(thread_pool& pool, const std::function<tile_result(const tile&, accumulation_buffer&)>& render_one) {
+	using namespace tile_server_detail;
+	const auto tiles = make_tiles(job_settings.width, job_settings.height, tile_size);
+	accumulation_buffer buffer;
+	buffer.reset(job_settings.width, job_settings.height);
+	render_stats stats;
+	auto start = std::chrono::steady_clock::now();
+
+	// Two tiles per thread keep the pool busy while a batch winds down
+	std::string request;
+	put_u32(request, static_cast<uint32_t>(2 * pool.size()));
+	size_t tiles_done = 0;
+	while (true) {
+		message type;
+		std::string payload;
+		send_message(fd, message::request, request); // A closed connection shows in the reply
+		if (!receive_message(fd, type, payload) || (type != message::tiles && type != message::done)) {
+			std::cerr << "\nERROR: Lost the coordinator.\n";
+			stats.interrupted = true;
+			break;
+		}
+		if (type == message::done) break;
+
+		byte_reader in(payload);
+		std::vector<uint32_t> ids(std::min<uint32_t>(in.u32(), uint32_t(tiles.size())));
+		for (auto& id : ids)
+			id = in.u32();
+		if (!in.ok() || std::any_of(ids.begin(), ids.end(), [&](uint32_t id) { return id >= tiles.size(); })) {
+			std::cerr << "\nERROR: Invalid tiles from the coordinator.\n";
+			stats.interrupted = true;
+			break;
+		}
+
+		std::vector<std::string> results(ids.size());
+		std::atomic<uint64_t> rays{ 0 };
+		std::atomic<uint64_t> samples{ 0 };
+		task_group group;
+		for (size_t k = 0; k < ids.size(); ++k)
+			pool.submit(group, [&, k] {
+				const auto& t = tiles[ids[k]];
+				for (int y = t.y0; y < t.y1; ++y)
+					for (int x = t.x0; x < t.x1; ++x) {
+						size_t n = size_t(y) * buffer.width + x;
+						buffer.sums[n] = color(0, 0, 0);
+						buffer.counts[n] = 0;
+						buffer.m2[n] = 0;
+					}
+				auto result = render_one(t, buffer);
+				auto& out = results[k];
+				put_u32(out, ids[k]);
+				put_u64(out, result.rays);
+				for (int y = t.y0; y < t.y1; ++y)
+					for (int x = t.x0; x < t.x1; ++x) {
+						size_t n = size_t(y) * buffer.width + x;
+						put_u32(out, buffer.counts[n]);
+						for (int c = 0; c < 3; ++c)
+							put_f64(out, buffer.sums[n][c]);
+					}
+				rays += result.rays;
+				samples += result.samples;
+			}, k * pool.size() / ids.size());
+		pool.wait(group);
+
+		stats.rays += rays;
+		stats.samples += samples;
+		tiles_done += ids.size();
+		if (!std::all_of(results.begin(), results.end(), [&](const std::string& result) { return send_message(fd, message::result, result); })) {
+			std::cerr << "\nERROR: Lost the coordinator.\n";
+			stats.interrupted = true;
+			break;
+		}
+		if (job_settings.progress)
+			std::cerr << "\rTiles rendered: " << tiles_done << "  " << std::flush;
+	}
+	if (job_settings.progress) std::cerr << "\n";
+	stats.passes = 1;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+#endif
@@ -44,6 +44,10 @@ public:
 		return v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
 	}
 
+	double max_component() const {
+		return std::fmax(v[0], std::fmax(v[1], v[2]));
+	}
+
 	bool near_zero() const {
 		constexpr auto epsilon = 1e-8;
 		return (fabs(v[0]) < epsilon) && (fabs(v[1]) < epsilon) && (fabs(v[2]) < epsilon);
@@ -104,22 +108,30 @@ public:
 	static inline vec3 random(double min, double max) {
 		return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
 	}
+
+	static inline vec3 random(sampler& rng) {
+		return vec3(rng.next_double(), rng.next_double(), rng.next_double());
+	}
+
+	static inline vec3 random(sampler& rng, double min, double max) {
+		return vec3(rng.next_double(min, max), rng.next_double(min, max), rng.next_double(min, max));
+	}
 };
 
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(sampler& rng) {
 	for (;;) {
-		auto p = vec3::random(-1, 1);
+		auto p = vec3::random(rng, -1, 1);
 		if (p.length_squared() >= 1) continue;
 		return p;
 	}
 }
 
-vec3 random_unit_vector() {
-	return unit_vector(random_in_unit_sphere());
+vec3 random_unit_vector(sampler& rng) {
+	return unit_vector(random_in_unit_sphere(rng));
 }
 
-vec3 random_in_hemisphere(const vec3& normal) {
-	vec3 in_unit_Sphere = random_in_unit_sphere();
+vec3 random_in_hemisphere(const vec3& normal, sampler& rng) {
+	vec3 in_unit_Sphere = random_in_unit_sphere(rng);
 	if (dot(in_unit_Sphere, normal) > 0.0)
 		return in_unit_Sphere;
 	return -in_unit_Sphere;
@@ -137,9 +149,9 @@ vec3 refract(const vec3& uv, const vec3& n, double eta_quotient) {
 	return r_perpendicular + r_parallel;
 }
 
-vec3 random_in_unit_disk() {
+vec3 random_in_unit_disk(sampler& rng) {
 	for (;;) {
-		auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+		auto p = vec3(rng.next_double(-1, 1), rng.next_double(-1, 1), 0);
 		if (p.length_squared() >= 1) continue;
 		return p;
 	}
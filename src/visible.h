@@ -1,16 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
 #include <optional>
+#include <utility>
 
+#include "common.h"
 #include "ray.h"
 #include "aabb.h"
+#include "random_number.h"
 
 class material;
 
 struct hit {
 	vec3 point;
 	vec3 normal;
-	std::shared_ptr<material> mat_ptr;
+	const material* mat_ptr; // Owned by the scene's material_table
 	double t;
 	double u;
 	double v;
@@ -22,32 +30,265 @@ struct hit {
 	}
 };
 
+class visible;
+
+// What traversal keeps of the nearest hit so far: its distance, the primitive
+// and the transforms between it and the root. The full hit is only built once
+// per ray, by surface().
+struct intersection {
+	static constexpr int max_instances = 8;
+
+	double t = infinity;
+	const visible* object = nullptr;
+	const visible* instances[max_instances]; // Innermost transform first
+	int instance_count = 0;
+
+	// Called by primitives, forgets the transforms of the previous nearest hit
+	void record(double hit_t, const visible* primitive) {
+		t = hit_t;
+		object = primitive;
+		instance_count = 0;
+	}
+
+	// Called by transforms whose primitive just became the nearest hit
+	void push_instance(const visible* transform) {
+		if (instance_count == max_instances) {
+			std::cerr << "ERROR: more than " << max_instances << " nested transforms.\n";
+			std::abort();
+		}
+		instances[instance_count++] = transform;
+	}
+
+	// Transform `level` of the stack, level 0 being the primitive itself
+	const visible* at(int level) const { return level > 0 ? instances[level - 1] : object; }
+
+	hit surface(const ray& r) const;
+};
+
+// Camera rays of neighbouring pixels traced together, see visible::intersect_packet.
+// Origins and directions are also kept by component, so tests of every ray in the
+// packet vectorize. When all rays point the same way along each axis, the bounds of
+// their origins and reciprocal directions let a traversal skip boxes none of them enters.
+struct ray_packet {
+	static constexpr int max_size = 256; // 16x16 pixels
+
+	int size = 0;
+	double t_min = 0.001;
+	ray rays[max_size];
+	sampler* samplers[max_size]; // Each ray's own, bound while media draw their distances
+	intersection isects[max_size];
+	double t_max[max_size]; // The nearest hit so far, isects[n].t
+	double origin[3][max_size];
+	double direction[3][max_size];
+	double inv_direction[3][max_size];
+
+	bool coherent = false;
+	double origin_min[3], origin_max[3];
+	double inv_min[3], inv_max[3];
+
+	void clear() { size = 0; }
+	void add(const ray& r, sampler& rng);
+	// Call once all rays are added, before tracing
+	void prepare();
+
+	void record(int n, double t, const visible* primitive) {
+		isects[n].record(t, primitive);
+		t_max[n] = t;
+	}
+
+	// Box tests as aabb::hit_check, bounds as [lower, upper][axis]
+	bool hits(int n, const double (&bounds)[2][3]) const;
+	// Whether no ray of a coherent packet can enter the box
+	bool frustum_misses(const double (&bounds)[2][3]) const;
+	// The first and the last ray of [first, last) that are active and enter the box,
+	// an empty range if none
+	std::pair<int, int> hit_range(const double (&bounds)[2][3], int first, int last, const uint8_t* active) const;
+	// Flags the rays of [first, last) that are active and enter the box
+	void hit_mask(const double (&bounds)[2][3], int first, int last, const uint8_t* active, uint8_t* out) const;
+};
+
+void ray_packet::add(const ray& r, sampler& rng) {
+	int n = size++;
+	rays[n] = r;
+	samplers[n] = &rng;
+	isects[n] = intersection{};
+	t_max[n] = infinity;
+	for (int a = 0; a < 3; ++a) {
+		origin[a][n] = r.origin()[a];
+		direction[a][n] = r.direction()[a];
+		inv_direction[a][n] = 1.0 / r.direction()[a];
+	}
+}
+
+void ray_packet::prepare() {
+	coherent = size > 0;
+	for (int a = 0; a < 3; ++a) {
+		origin_min[a] = origin_max[a] = origin[a][0];
+		inv_min[a] = inv_max[a] = inv_direction[a][0];
+		for (int n = 1; n < size; ++n) {
+			origin_min[a] = std::min(origin_min[a], origin[a][n]);
+			origin_max[a] = std::max(origin_max[a], origin[a][n]);
+			inv_min[a] = std::min(inv_min[a], inv_direction[a][n]);
+			inv_max[a] = std::max(inv_max[a], inv_direction[a][n]);
+		}
+		// Rays along a plane of the axis make infinite, NaN-prone products
+		coherent = coherent && std::isfinite(inv_min[a]) && std::isfinite(inv_max[a]) && (inv_min[a] > 0 || inv_max[a] < 0);
+	}
+}
+
+inline bool ray_packet::hits(int n, const double (&bounds)[2][3]) const {
+	double near = t_min, far = t_max[n];
+	for (int a = 0; a < 3; ++a) {
+		int negative = std::signbit(inv_direction[a][n]) ? 1 : 0;
+		clip_slab(bounds[negative][a], bounds[1 - negative][a], origin[a][n], inv_direction[a][n], near, far);
+	}
+	return near < far;
+}
+
+// Interval arithmetic: every ray enters each slab no sooner than the smallest product of
+// its planes' offsets from the origins and the reciprocals, and leaves it no later than
+// the largest. Rounding is monotonic, so the bounds hold for the rays' own products too.
+inline bool ray_packet::frustum_misses(const double (&bounds)[2][3]) const {
+	if (!coherent) return false;
+	double entry = t_min, exit = infinity;
+	for (int a = 0; a < 3; ++a) {
+		int negative = inv_max[a] < 0 ? 1 : 0;
+		double near_lo = bounds[negative][a] - origin_max[a], near_hi = bounds[negative][a] - origin_min[a];
+		double far_lo = bounds[1 - negative][a] - origin_max[a], far_hi = bounds[1 - negative][a] - origin_min[a];
+		entry = std::max(entry, std::min({ near_lo * inv_min[a], near_lo * inv_max[a], near_hi * inv_min[a], near_hi * inv_max[a] }));
+		exit = std::min(exit, std::max({ far_lo * inv_min[a], far_lo * inv_max[a], far_hi * inv_min[a], far_hi * inv_max[a] }));
+	}
+	return entry > exit;
+}
+
+inline std::pair<int, int> ray_packet::hit_range(const double (&bounds)[2][3], int first, int last, const uint8_t* active) const {
+	// Neighbouring rays mostly agree, so the first one decides before the frustum is worth testing
+	if (!(active[first] && hits(first, bounds))) {
+		if (frustum_misses(bounds)) return { first, first };
+		do
+			++first;
+		while (first < last && !(active[first] && hits(first, bounds)));
+		if (first == last) return { first, first };
+	}
+	while (last - 1 > first && !(active[last - 1] && hits(last - 1, bounds)))
+		--last;
+	return { first, last };
+}
+
+// hits() on every ray, two at a time with SSE2
+inline void ray_packet::hit_mask(const double (&bounds)[2][3], int first, int last, const uint8_t* active, uint8_t* out) const {
+	int n = first;
+#ifdef RAYTRACER_X86
+	for (; n + 2 <= last; n += 2) {
+		__m128d near = _mm_set1_pd(t_min);
+		__m128d far = _mm_loadu_pd(&t_max[n]);
+		for (int a = 0; a < 3; ++a) {
+			__m128d inv = _mm_loadu_pd(&inv_direction[a][n]);
+			__m128d o = _mm_loadu_pd(&origin[a][n]);
+			__m128d negative = _mm_cmplt_pd(inv, _mm_setzero_pd());
+			__m128d lo = _mm_set1_pd(bounds[0][a]), hi = _mm_set1_pd(bounds[1][a]);
+			__m128d near_plane = _mm_or_pd(_mm_and_pd(negative, hi), _mm_andnot_pd(negative, lo));
+			__m128d far_plane = _mm_or_pd(_mm_and_pd(negative, lo), _mm_andnot_pd(negative, hi));
+			// maxpd and minpd keep the second operand when the first is NaN, as clip_slab does
+			near = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(near_plane, o), inv), near);
+			far = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(far_plane, o), inv), far);
+		}
+		int mask = _mm_movemask_pd(_mm_cmplt_pd(near, far));
+		out[n] = active[n] & mask;
+		out[n + 1] = active[n + 1] & (mask >> 1);
+	}
+#endif
+	for (; n < last; ++n)
+		out[n] = active[n] && hits(n, bounds);
+}
+
+// Kinds of primitive, for statistics
+enum class primitive_type { sphere, moving_sphere, xy_rect, xz_rect, yz_rect, constant_medium, other };
+constexpr int primitive_type_count = 7;
+
 class visible {
 public:
-	virtual std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const = 0;
+	// Narrows `isect` if something is hit closer than t_max, without building a hit record
+	virtual bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const = 0;
 	virtual std::optional<aabb> bounding_box(double time0, double time1) const = 0;
+
+	// Whether anything is hit in [t_min, t_max], stopping at the first intersection found. Primitives
+	// keep this default, containers and transforms override it to skip the search for the nearest hit.
+	// Media draw a distance per test from the bound sampler, so stopping early changes how many
+	// numbers a shadow ray takes from the sample's stream and with it the noise of media scenes.
+	virtual bool occluded(const ray& r, double t_min, double t_max) const {
+		intersection isect;
+		return intersect(r, t_min, t_max, isect);
+	}
+
+	// Narrows the intersections of the packet's rays in [first, last) whose `active` flag is set.
+	// This tests them one at a time, hierarchies and primitives with a vectorized test override it.
+	virtual void intersect_packet(ray_packet& packet, int first, int last, const uint8_t* active) const;
+
+	// Shading data for an intersection this object recorded, `level` is its place in the instance stack.
+	// Only primitives and transforms are ever recorded, containers keep this default.
+	virtual hit surface(const ray& r, const intersection& isect, int level) const { return hit{}; }
+	// What kind of primitive this is, only asked of recorded primitives
+	virtual primitive_type type() const { return primitive_type::other; }
+
+	// Area light sampling, for the primitives that support it: the material they emit with
+	// (null if they cannot be sampled), the solid angle density of random() choosing
+	// `direction` from `origin`, and a random direction from `origin` towards the primitive
+	virtual const material* light_material() const { return nullptr; }
+	virtual double pdf_value(const vec3& origin, const vec3& direction) const { return 0.0; }
+	virtual vec3 random(const vec3& origin, sampler& rng) const { return vec3(1, 0, 0); }
+
+	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const {
+		intersection isect;
+		if (!intersect(r, t_min, t_max, isect)) return std::nullopt;
+		return isect.surface(r);
+	}
 };
 
+void visible::intersect_packet(ray_packet& packet, int first, int last, const uint8_t* active) const {
+	for (int n = first; n < last; ++n) {
+		if (!active[n]) continue;
+		sampler_scope bind(*packet.samplers[n]);
+		if (intersect(packet.rays[n], packet.t_min, packet.t_max[n], packet.isects[n]))
+			packet.t_max[n] = packet.isects[n].t;
+	}
+}
+
+inline hit intersection::surface(const ray& r) const {
+	return at(instance_count)->surface(r, *this, instance_count);
+}
+
 class translate : public visible {
 public:
 	translate(std::shared_ptr<visible> primitive, const vec3& displacement)
 		: p(primitive), offset(displacement) {}
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	bool occluded(const ray& r, double t_min, double t_max) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override;
+	hit surface(const ray& r, const intersection& isect, int level) const override;
 
 private:
 	std::shared_ptr<visible> p;
 	vec3 offset;
 };
 
-std::optional<hit> translate::hit_check(const ray& r, double t_min, double t_max) const {
+bool translate::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
 	ray offset_r{ r.origin() - offset, r.direction(), r.time() };
-	auto rec = p->hit_check(offset_r, t_min, t_max);
-	if (rec) {
-		rec->point += offset;
-		rec->set_face_normal(offset_r, rec->normal);
-	}
+	if (!p->intersect(offset_r, t_min, t_max, isect)) return false;
+	isect.push_instance(this);
+	return true;
+}
+
+bool translate::occluded(const ray& r, double t_min, double t_max) const {
+	return p->occluded(ray{ r.origin() - offset, r.direction(), r.time() }, t_min, t_max);
+}
+
+hit translate::surface(const ray& r, const intersection& isect, int level) const {
+	ray offset_r{ r.origin() - offset, r.direction(), r.time() };
+	auto rec = isect.at(level - 1)->surface(offset_r, isect, level - 1);
+	rec.point += offset;
+	rec.set_face_normal(offset_r, rec.normal);
 	return rec;
 }
 
@@ -66,12 +307,18 @@ class rotate_y : public visible {
 public:
 	rotate_y(std::shared_ptr<visible> primitive, double angle);
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	bool occluded(const ray& r, double t_min, double t_max) const override {
+		return p->occluded(rotate(r), t_min, t_max);
+	}
 	std::optional<aabb> bounding_box(double time0, double time1) const override {
 		return bbox;
 	}
+	hit surface(const ray& r, const intersection& isect, int level) const override;
 
 private:
+	ray rotate(const ray& r) const;
+
 	std::shared_ptr<visible> p;
 	double sin_theta;
 	double cos_theta;
@@ -101,7 +348,7 @@ rotate_y::rotate_y(std::shared_ptr<visible> primitive, double angle) : p(primiti
 				}
 }
 
-std::optional<hit> rotate_y::hit_check(const ray& r, double t_min, double t_max) const {
+ray rotate_y::rotate(const ray& r) const {
 	vec3 origin{
 		cos_theta * r.origin()[0] - sin_theta * r.origin()[2],
 		r.origin()[1],
@@ -112,21 +359,28 @@ std::optional<hit> rotate_y::hit_check(const ray& r, double t_min, double t_max)
 		r.direction()[1],
 		sin_theta * r.direction()[0] + cos_theta * r.direction()[2],
 	};
-	ray rotated_r{ origin, direction, r.time() };
-
-	auto rec = p->hit_check(rotated_r, t_min, t_max);
-	if (rec) {
-		rec->point = vec3{
-			cos_theta * rec->point[0] + sin_theta * rec->point[2],
-			rec->point[1],
-			-sin_theta * rec->point[0] + cos_theta * rec->point[2],
-		};
-		auto normal = vec3{
-			cos_theta * rec->normal[0] + sin_theta * rec->normal[2],
-			rec->normal[1],
-			-sin_theta * rec->normal[0] + cos_theta * rec->normal[2],
-		};
-		rec->set_face_normal(rotated_r, normal);
-	}
+	return ray{ origin, direction, r.time() };
+}
+
+bool rotate_y::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
+	if (!p->intersect(rotate(r), t_min, t_max, isect)) return false;
+	isect.push_instance(this);
+	return true;
+}
+
+hit rotate_y::surface(const ray& r, const intersection& isect, int level) const {
+	ray rotated_r = rotate(r);
+	auto rec = isect.at(level - 1)->surface(rotated_r, isect, level - 1);
+	rec.point = vec3{
+		cos_theta * rec.point[0] + sin_theta * rec.point[2],
+		rec.point[1],
+		-sin_theta * rec.point[0] + cos_theta * rec.point[2],
+	};
+	auto normal = vec3{
+		cos_theta * rec.normal[0] + sin_theta * rec.normal[2],
+		rec.normal[1],
+		-sin_theta * rec.normal[0] + cos_theta * rec.normal[2],
+	};
+	rec.set_face_normal(rotated_r, normal);
 	return rec;
 }
\ No newline at end of file
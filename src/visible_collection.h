@@ -14,29 +14,43 @@ public:
 	void clear() { objects.clear(); }
 	void add(std::shared_ptr<visible> object) { objects.push_back(object); }
 
-	std::optional<hit> hit_check(const ray& r, double t_min, double t_max) const override;
+	size_t size() const { return objects.size(); }
+	bool empty() const { return objects.empty(); }
+	auto begin() const { return objects.begin(); }
+	auto end() const { return objects.end(); }
+
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	bool occluded(const ray& r, double t_min, double t_max) const override;
 	std::optional<aabb> bounding_box(double time0, double time1) const override;
 
+	// Sampling a collection of lights picks one of them uniformly
+	double pdf_value(const vec3& origin, const vec3& direction) const override;
+	vec3 random(const vec3& origin, sampler& rng) const override;
+
 private:
 	friend class bvh_node;
 	std::vector<std::shared_ptr<visible>> objects;
 };
 
-std::optional<hit> visible_collection::hit_check(const ray& r, double t_min, double t_max) const {
-	std::optional<hit> rec = std::nullopt;
+bool visible_collection::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
+	bool hit_anything = false;
 	double closest = t_max;
 
 	for (const auto& object : objects) {
-		auto temp_rec = object->hit_check(r, t_min, closest);
-		if (temp_rec) {
-			closest = temp_rec->t;
-			rec = std::move(temp_rec);
+		if (object->intersect(r, t_min, closest, isect)) {
+			closest = isect.t;
+			hit_anything = true;
 		}
 	}
 
-	return rec;
+	return hit_anything;
 }
 
+bool visible_collection::occluded(const ray& r, double t_min, double t_max) const {
+	for (const auto& object : objects)
+		if (object->occluded(r, t_min, t_max)) return true;
+	return false;
+}
 
 std::optional<aabb> visible_collection::bounding_box(double time0, double time1) const {
 	if (objects.empty()) return std::nullopt;
@@ -50,4 +64,17 @@ std::optional<aabb> visible_collection::bounding_box(double time0, double time1)
 		first = false;
 	}
 	return output;
-}
\ No newline at end of file
+}
+
+double visible_collection::pdf_value(const vec3& origin, const vec3& direction) const {
+	if (objects.empty()) return 0;
+	double sum = 0;
+	for (const auto& object : objects)
+		sum += object->pdf_value(origin, direction);
+	return sum / objects.size();
+}
+
+vec3 visible_collection::random(const vec3& origin, sampler& rng) const {
+	if (objects.empty()) return vec3(1, 0, 0);
+	return objects[rng.next() % objects.size()]->random(origin, rng);
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "linear_bvh.h"
+
+#ifdef RAYTRACER_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RAYTRACER_TARGET_AVX2
+#else
+#define RAYTRACER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Node of a W-wide BVH. Child bounds are stored by axis, so one SIMD slab test covers
+// every child. Interior children index `child` into the node array; leaves keep their
+// first primitive there and a nonzero `count`. Unused slots have bounds at +infinity,
+// which no ray can hit.
+template <int W>
+struct alignas(sizeof(float) * W) wide_bvh_node {
+	float bounds[2][3][W]; // Lower and upper planes of each child, by axis
+	uint32_t child[W];
+	uint32_t count[W];
+};
+
+namespace wide_bvh_detail {
+
+	// A traversal_ray in the precision of the node bounds. Across lanes a min and a max
+	// order each slab more cheaply than loading the planes the direction's signs pick.
+	struct float_ray {
+		float origin[3];
+		float inv_direction[3];
+	};
+
+	inline float_ray make_float_ray(const traversal_ray& tr) {
+		float_ray fr;
+		for (int a = 0; a < 3; ++a) {
+			fr.origin[a] = static_cast<float>(tr.origin[a]);
+			fr.inv_direction[a] = static_cast<float>(tr.inv_direction[a]);
+		}
+		return fr;
+	}
+
+	// Rounds up, so boxes the double interval reaches are never culled by the conversion,
+	// but stays finite: unused slots are entered at infinity and must still miss
+	inline float float_above(double value) {
+		auto f = static_cast<float>(value);
+		if (f < value) f = std::nextafter(f, std::numeric_limits<float>::infinity());
+		return std::min(f, FLT_MAX);
+	}
+
+	// Shrinks the entry distances compared against the exit ones to cover the float
+	// rounding of the slab test; a ray entering a box at infinity stays a miss
+	constexpr float near_scale = 1 - 4 * FLT_EPSILON;
+
+	// Slab tests of all children of a node: returns a bit per child whose box the ray
+	// enters within [t_min, t_max] and writes the entry distances to `t_near`. The min and
+	// max follow minps/maxps, keeping the second operand when the first is NaN, so as in
+	// clip_slab an axis whose product is NaN is skipped.
+	template <int W>
+	using node_test = int (*)(const wide_bvh_node<W>&, const float_ray&, float t_min, float t_max, float* t_near);
+
+	template <int W>
+	int test_scalar(const wide_bvh_node<W>& node, const float_ray& r, float t_min, float t_max, float* t_near) {
+		int mask = 0;
+		for (int i = 0; i < W; ++i) {
+			float near = t_min, far = t_max;
+			for (int a = 0; a < 3; ++a) {
+				float t0 = (node.bounds[0][a][i] - r.origin[a]) * r.inv_direction[a];
+				float t1 = (node.bounds[1][a][i] - r.origin[a]) * r.inv_direction[a];
+				float lo = t0 < t1 ? t0 : t1;
+				float hi = t0 > t1 ? t0 : t1;
+				near = lo > near ? lo : near;
+				far = hi < far ? hi : far;
+			}
+			t_near[i] = near;
+			if (near * near_scale <= far) mask |= 1 << i;
+		}
+		return mask;
+	}
+
+#ifdef RAYTRACER_X86
+	// SSE is part of every x86-64 CPU
+	inline int test_sse(const wide_bvh_node<4>& node, const float_ray& r, float t_min, float t_max, float* t_near) {
+		__m128 near = _mm_set1_ps(t_min);
+		__m128 far = _mm_set1_ps(t_max);
+		for (int a = 0; a < 3; ++a) {
+			__m128 origin = _mm_set1_ps(r.origin[a]);
+			__m128 inv = _mm_set1_ps(r.inv_direction[a]);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0][a]), origin), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1][a]), origin), inv);
+			near = _mm_max_ps(_mm_min_ps(t0, t1), near);
+			far = _mm_min_ps(_mm_max_ps(t0, t1), far);
+		}
+		_mm_storeu_ps(t_near, near);
+		return _mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(near, _mm_set1_ps(near_scale)), far));
+	}
+
+	RAYTRACER_TARGET_AVX2 inline int test_avx2(const wide_bvh_node<8>& node, const float_ray& r, float t_min, float t_max, float* t_near) {
+		__m256 near = _mm256_set1_ps(t_min);
+		__m256 far = _mm256_set1_ps(t_max);
+		for (int a = 0; a < 3; ++a) {
+			__m256 origin = _mm256_set1_ps(r.origin[a]);
+			__m256 inv = _mm256_set1_ps(r.inv_direction[a]);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[0][a]), origin), inv);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1][a]), origin), inv);
+			near = _mm256_max_ps(_mm256_min_ps(t0, t1), near);
+			far = _mm256_min_ps(_mm256_max_ps(t0, t1), far);
+		}
+		_mm256_storeu_ps(t_near, near);
+		return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_mul_ps(near, _mm256_set1_ps(near_scale)), far, _CMP_LE_OQ));
+	}
+#endif
+
+	inline bool cpu_has_avx2() {
+#if defined(RAYTRACER_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 7, 0);
+		return os_saves_ymm && (info[1] & (1 << 5));
+#elif defined(RAYTRACER_X86)
+		return __builtin_cpu_supports("avx2");
+#else
+		return false;
+#endif
+	}
+
+}
+
+// Layouts of the acceleration structure the renderer can trace against
+enum class bvh_layout { binary, wide4, wide8, automatic };
+
+std::optional<bvh_layout> bvh_layout_from_name(const std::string& name) {
+	if (name == "binary") return bvh_layout::binary;
+	if (name == "wide4") return bvh_layout::wide4;
+	if (name == "wide8") return bvh_layout::wide8;
+	if (name == "auto") return bvh_layout::automatic;
+	return std::nullopt;
+}
+
+// The widest layout this CPU has a vector node test for
+inline bvh_layout best_bvh_layout() {
+#ifdef RAYTRACER_X86
+	return wide_bvh_detail::cpu_has_avx2() ? bvh_layout::wide8 : bvh_layout::wide4;
+#else
+	return bvh_layout::binary;
+#endif
+}
+
+// A linear_bvh collapsed into W-wide nodes: every node pulls up the grandchildren of
+// its largest interior children until it has W of them. Traversal tests all children
+// at once with the widest node test the CPU supports, chosen at construction, and
+// visits the hit children nearest first.
+template <int W>
+class wide_bvh final : public visible {
+public:
+	explicit wide_bvh(const linear_bvh& binary);
+
+	bool intersect(const ray& r, double t_min, double t_max, intersection& isect) const override;
+	bool occluded(const ray& r, double t_min, double t_max) const override;
+	std::optional<aabb> bounding_box(double time0, double time1) const override { return box; }
+
+	size_t node_count() const { return nodes.size(); }
+	const char* kernel_name() const { return kernel; }
+
+private:
+	static constexpr int max_depth = 64; // As linear_bvh, a collapsed tree is never deeper
+	static constexpr int stack_size = max_depth * W;
+
+	struct stack_entry {
+		uint32_t child;
+		uint32_t count;
+		float t_near;
+	};
+
+	uint32_t collapse(const std::vector<linear_bvh_node>& binary, uint32_t index);
+
+	std::vector<wide_bvh_node<W>> nodes;
+	std::vector<const visible*> primitives;
+	std::vector<std::shared_ptr<visible>> owners;
+	wide_bvh_detail::node_test<W> test = wide_bvh_detail::test_scalar<W>;
+	const char* kernel = "scalar";
+	aabb box;
+};
+
+template <int W>
+wide_bvh<W>::wide_bvh(const linear_bvh& binary)
+	: primitives(binary.primitive_array()), owners(binary.primitive_owners()), box(*binary.bounding_box(0, 1)) {
+#ifdef RAYTRACER_X86
+	if constexpr (W == 4) {
+		test = wide_bvh_detail::test_sse;
+		kernel = "SSE";
+	}
+	else if constexpr (W == 8) {
+		if (wide_bvh_detail::cpu_has_avx2()) {
+			test = wide_bvh_detail::test_avx2;
+			kernel = "AVX2";
+		}
+	}
+#endif
+	collapse(binary.node_array(), 0);
+}
+
+template <int W>
+uint32_t wide_bvh<W>::collapse(const std::vector<linear_bvh_node>& binary, uint32_t index) {
+	auto area = [&](uint32_t n) {
+		const auto& b = binary[n].bounds;
+		float dx = b[1][0] - b[0][0], dy = b[1][1] - b[0][1], dz = b[1][2] - b[0][2];
+		return dx * dy + dy * dz + dz * dx;
+	};
+
+	// A binary leaf only reaches here as the root, and becomes a node with one child
+	std::vector<uint32_t> children;
+	if (binary[index].count > 0)
+		children = { index };
+	else
+		children = { index + 1, binary[index].offset };
+	while (children.size() < size_t(W)) {
+		int widest = -1;
+		for (size_t k = 0; k < children.size(); ++k)
+			if (binary[children[k]].count == 0 && (widest < 0 || area(children[k]) > area(children[widest])))
+				widest = int(k);
+		if (widest < 0) break;
+		auto opened = children[widest];
+		children[widest] = opened + 1;
+		children.push_back(binary[opened].offset);
+	}
+
+	auto wide_index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+	for (int i = 0; i < W; ++i) {
+		for (int a = 0; a < 3; ++a)
+			nodes[wide_index].bounds[0][a][i] = nodes[wide_index].bounds[1][a][i] = std::numeric_limits<float>::infinity();
+		nodes[wide_index].child[i] = 0;
+		nodes[wide_index].count[i] = 0;
+	}
+	for (size_t k = 0; k < children.size(); ++k) {
+		const auto& child = binary[children[k]];
+		// Collapse first, it grows `nodes`
+		auto target = child.count > 0 ? child.offset : collapse(binary, children[k]);
+		auto& node = nodes[wide_index];
+		for (int a = 0; a < 3; ++a) {
+			node.bounds[0][a][k] = child.bounds[0][a];
+			node.bounds[1][a][k] = child.bounds[1][a];
+		}
+		node.child[k] = target;
+		node.count[k] = child.count;
+	}
+	return wide_index;
+}
+
+template <int W>
+bool wide_bvh<W>::intersect(const ray& r, double t_min, double t_max, intersection& isect) const {
+	using namespace wide_bvh_detail;
+	traversal_count count;
+	const auto tr = make_float_ray(traversal_ray(r));
+	const auto near_limit = static_cast<float>(t_min);
+	bool hit_anything = false;
+
+	stack_entry stack[stack_size];
+	int top = 0;
+	stack[top++] = { 0, 0, near_limit };
+	while (top > 0) {
+		auto entry = stack[--top];
+		// Something nearer was hit since it was pushed, with the node test's rounding allowance
+		if (entry.t_near * near_scale > float_above(t_max)) continue;
+		if (entry.count > 0) {
+			count.tests += entry.count;
+			for (uint32_t i = entry.child; i < entry.child + entry.count; ++i)
+				if (primitives[i]->intersect(r, t_min, t_max, isect)) {
+					t_max = isect.t;
+					hit_anything = true;
+				}
+			continue;
+		}
+
+		const auto& node = nodes[entry.child];
+		++count.nodes;
+		float t_near[W];
+		auto mask = static_cast<unsigned>(test(node, tr, near_limit, float_above(t_max), t_near));
+		// Hit children go on the stack farthest first, so the nearest is visited next
+		const int first = top;
+		while (mask) {
+			int i = std::countr_zero(mask);
+			mask &= mask - 1;
+			stack_entry child{ node.child[i], node.count[i], t_near[i] };
+			int j = top++;
+			for (; j > first && stack[j - 1].t_near < child.t_near; --j)
+				stack[j] = stack[j - 1];
+			stack[j] = child;
+		}
+	}
+	return hit_anything;
+}
+
+// Same traversal without ordering children or narrowing t_max, returns at the first primitive hit
+template <int W>
+bool wide_bvh<W>::occluded(const ray& r, double t_min, double t_max) const {
+	using namespace wide_bvh_detail;
+	traversal_count count;
+	const auto tr = make_float_ray(traversal_ray(r));
+	const auto near_limit = static_cast<float>(t_min);
+	const auto far_limit = float_above(t_max);
+
+	stack_entry stack[stack_size];
+	int top = 0;
+	stack[top++] = { 0, 0, near_limit };
+	while (top > 0) {
+		auto entry = stack[--top];
+		if (entry.count > 0) {
+			for (uint32_t i = entry.child; i < entry.child + entry.count; ++i) {
+				++count.tests;
+				if (primitives[i]->occluded(r, t_min, t_max)) return true;
+			}
+			continue;
+		}
+
+		const auto& node = nodes[entry.child];
+		++count.nodes;
+		float t_near[W];
+		auto mask = static_cast<unsigned>(test(node, tr, near_limit, far_limit, t_near));
+		while (mask) {
+			int i = std::countr_zero(mask);
+			mask &= mask - 1;
+			stack[top++] = { node.child[i], node.count[i], t_near[i] };
+		}
+	}
+	return false;
+}